@@ -2,213 +2,2930 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 /* ===================== STRUKTURY ===================== */
 
 typedef struct {
     off_t start;
     size_t size;
+    long lines;     // poprawne linie przed pierwszym błędem (wypełnia worker)
+    int file;       // numer pliku wejściowego w inputs
 } fragment_t;
 
-typedef struct node {
-    char *line;
-    struct node *prev, *next;
-} node_t;
+typedef struct {
+    const char *line;   // widok na linię w zmapowanym pliku (bez kopii)
+    size_t len;
+} line_t;
+
+// Kawałek listy - tablica widoków linii leżąca ciągiem w arenie wątku
+typedef struct chunk {
+    struct chunk *next;
+    size_t count, cap;
+    line_t lines[];
+} chunk_t;
 
 typedef struct {
-    node_t *head, *tail;
+    chunk_t *head, *tail;
+    size_t bytes;       // łączna długość linii - rozmiar wyjścia fragmentu
 } list_t;
 
+// Region areny - jeden mmap, z którego kawałki są wydzielane przesunięciem wskaźnika
+typedef struct region {
+    struct region *next;
+    size_t size;
+} region_t;
+
+typedef struct {
+    region_t *regions;
+    char *cur, *end;
+    long region_count, chunk_count;
+} arena_t;
+
+#define VALIDATE_BLOCK (1 << 20)   // co tyle bajtów worker sprawdza, czy ma przerwać
+#define ARENA_REGION (4 << 20)
+#define CHUNK_MIN 64
+#define CHUNK_MAX 65536
+#define CLAIM_MIN_NS 1000000L      // pobranie krótsze niż 1 ms - następne dwa razy większe
+#define CLAIM_MAX_NS 8000000L      // dłuższe niż 8 ms - następne dwa razy mniejsze
+#define CLAIM_MAX 1024
+#define QUOTE_SERIAL_MAX (16 << 20) // -q: mniejsze pliki liczą cudzysłowy bez dodatkowych wątków
+
 /* ===================== GLOBALNE ===================== */
 
 fragment_t *tasks;
+list_t *results;       // wyniki osobno dla każdego fragmentu, w kolejności pliku
 int task_count;
-int next_task = 0;
+atomic_int next_task = 0;     // kolejny wolny fragment, pobierany przez fetch-add
+int worker_count;
+int adaptive;                 // auto m: liczba fragmentów na pobranie zależy od przepustowości
+atomic_int claims = 0;        // liczba pobrań z kolejki (do statystyk)
+
+// Plik wejściowy - zmapowany raz w main(); jego fragmenty leżą w tasks ciągiem
+typedef struct {
+    char *path;
+    const char *data;
+    size_t len;
+    struct stat st;
+    int first_task, ntasks;
+    uint64_t first_row;        // wiersze pominięte przez -r (do numeru linii błędu)
+    atomic_int error_frag;     // najniższy numer fragmentu z błędem CSV w tym pliku
+    int out_fd;
+    off_t newline_at;          // write_output: offset '\n' dopisanego przed wynikiem następnego pliku; -1 - brak
+} input_t;
 
-pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
+input_t *inputs;
+int input_count;
 
-volatile int error_flag = 0;
-long error_line = -1;
+const char *data;      // plik, który main() właśnie dzieli na fragmenty
+size_t data_len;
 
-pthread_barrier_t error_barrier;
+/* ===================== ARENA ===================== */
+
+// Inicjalizuje pustą arenę (pierwszy region powstaje przy pierwszej alokacji)
+void arena_init(arena_t *a) {
+    memset(a, 0, sizeof(*a));
+}
 
-int active_threads;
-pthread_mutex_t active_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Przydziela size bajtów z bieżącego regionu, a gdy brakuje miejsca mapuje nowy
+void *arena_alloc(arena_t *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if ((size_t)(a->end - a->cur) < size) {
+        size_t rsize = size + sizeof(region_t) > ARENA_REGION ? size + sizeof(region_t) : ARENA_REGION;
+        region_t *r = mmap(NULL, rsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        r->size = rsize;
+        r->next = a->regions;
+        a->regions = r;
+        a->region_count++;
+        a->cur = (char *)r + ((sizeof(region_t) + 15) & ~(size_t)15);
+        a->end = (char *)r + rsize;
+    }
+    void *p = a->cur;
+    a->cur += size;
+    return p;
+}
 
-const char *path;
+// Zwalnia całą arenę - po jednym munmap na region
+void arena_free(arena_t *a) {
+    region_t *r = a->regions;
+    while (r) {
+        region_t *next = r->next;
+        munmap(r, r->size);
+        r = next;
+    }
+    arena_init(a);
+}
 
 /* ===================== LISTA ===================== */
 
-// Inicjalizuje pustą listę dwukierunkową
+// Inicjalizuje pustą listę kawałków
 void list_init(list_t *l) {
     l->head = l->tail = NULL;
+    l->bytes = 0;
 }
 
-// Dodaje nową linię na koniec listy (kopiuje string)
-void list_push(list_t *l, const char *line) {
-    node_t *n = malloc(sizeof(node_t));
-    n->line = strdup(line);
-    n->next = NULL;
-    n->prev = l->tail;
-    if (l->tail) l->tail->next = n;
-    else l->head = n;
-    l->tail = n;
+// Dodaje nową linię na koniec listy (zapamiętuje tylko wskaźnik i długość).
+// Kolejne kawałki rosną dwukrotnie aż do CHUNK_MAX linii.
+void list_push(list_t *l, arena_t *a, const char *line, size_t len) {
+    chunk_t *c = l->tail;
+    if (!c || c->count == c->cap) {
+        size_t cap = c ? c->cap * 2 : CHUNK_MIN;
+        if (cap > CHUNK_MAX) cap = CHUNK_MAX;
+        chunk_t *n = arena_alloc(a, sizeof(chunk_t) + cap * sizeof(line_t));
+        n->next = NULL;
+        n->count = 0;
+        n->cap = cap;
+        a->chunk_count++;
+        if (c) c->next = n;
+        else l->head = n;
+        l->tail = c = n;
+    }
+    c->lines[c->count].line = line;
+    c->lines[c->count].len = len;
+    c->count++;
+    l->bytes += len;
 }
 
-// Łączy dwie listy - dodaje całą listę src na koniec dst
+// Łączy dwie listy - dodaje całą listę src na koniec dst (bez kopiowania linii)
 void list_append(list_t *dst, list_t *src) {
     if (!src->head) return;
     if (!dst->head) {
         *dst = *src;
     } else {
         dst->tail->next = src->head;
-        src->head->prev = dst->tail;
         dst->tail = src->tail;
+        dst->bytes += src->bytes;
     }
 }
 
 /* ===================== CSV ===================== */
 
 // Sprawdza czy linia to poprawny format CSV (dokładnie jeden przecinek)
-int valid_csv_line(const char *line) {
+int valid_csv_line(const char *line, size_t len) {
     int commas = 0;
-    for (const char *p = line; *p; p++)
+    for (const char *p = line; p < line + len; p++)
         if (*p == ',') commas++;
     return commas == 1;
 }
 
-/* ===================== WORKER ===================== */
+/* ===================== SIMD ===================== */
 
-// Funkcja wątku roboczego - przetwarza fragmenty pliku CSV
-// Sprawdza poprawność linii i dodaje je do lokalnej listy
-void *worker(void *arg) {
-    list_t *local = arg;
+// Skalarny wariant wyszukiwania końca linii (zwraca NULL gdy brak '\n')
+static const char *find_newline_scalar(const char *p, const char *end) {
+    return memchr(p, '\n', end - p);
+}
 
-    while (1) {
-        fragment_t frag;
+#ifdef __x86_64__
+// Szuka '\n' porównując po 16 bajtów naraz (SSE2 jest zawsze na x86-64)
+static const char *find_newline_sse2(const char *p, const char *end) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_newline_scalar(p, end);
+}
 
-        pthread_mutex_lock(&task_mutex);
-        if (next_task >= task_count || error_flag) {
-            pthread_mutex_unlock(&task_mutex);
-            break;
+// To samo na rejestrach 32-bajtowych, wybierane tylko gdy CPU ma AVX2
+__attribute__((target("avx2")))
+static const char *find_newline_avx2(const char *p, const char *end) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_newline_sse2(p, end);
+}
+#endif
+
+const char *(*find_newline)(const char *, const char *) = find_newline_scalar;
+// Koniec rekordu: zwykle pierwszy '\n', w trybie -q pierwszy '\n' poza cudzysłowem
+const char *(*find_record_end)(const char *, const char *) = find_newline_scalar;
+
+// Skalarny walidator bloku: sprawdza rekordy w [p, end) linia po linii.
+// Zwraca początek pierwszego błędnego rekordu albo NULL gdy wszystkie są poprawne.
+static const char *validate_block_scalar(const char *p, const char *end) {
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t len = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+        if (!valid_csv_line(p, len)) return p;
+        p += len;
+    }
+    return NULL;
+}
+
+// Wspólne jądro walidatorów wektorowych: dostaje maski '\n' i ',' dla 64 bajtów
+// od base i rozlicza przecinki rekord po rekord (popcount między kolejnymi '\n').
+// *rec to początek bieżącego rekordu, *commas - przecinki zliczone w nim do tej pory.
+static inline const char *scan_masks(uint64_t nl, uint64_t cm, const char *base,
+                                     const char **rec, int *commas) {
+    while (nl) {
+        int pos = __builtin_ctzll(nl);
+        uint64_t upto = (pos == 63) ? ~0ULL : (2ULL << pos) - 1;
+        *commas += __builtin_popcountll(cm & upto);
+        if (*commas != 1) return *rec;
+        cm &= ~upto;
+        nl &= nl - 1;
+        *rec = base + pos + 1;
+        *commas = 0;
+    }
+    *commas += __builtin_popcountll(cm);
+    return NULL;
+}
+
+// Dokończenie bloku krótszego niż 64 bajty i ostatniego rekordu bez '\n'
+static inline const char *scan_tail(const char *p, const char *end, const char *rec, int commas) {
+    for (; p < end; p++) {
+        if (*p == ',') {
+            commas++;
+        } else if (*p == '\n') {
+            if (commas != 1) return rec;
+            rec = p + 1;
+            commas = 0;
+        }
+    }
+    if (rec < end && commas != 1) return rec;
+    return NULL;
+}
+
+#ifdef __x86_64__
+__attribute__((target("popcnt")))
+static const char *validate_block_sse2(const char *p, const char *end) {
+    const __m128i nlv = _mm_set1_epi8('\n'), cmv = _mm_set1_epi8(',');
+    const char *rec = p, *bad;
+    int commas = 0;
+    for (; end - p >= 64; p += 64) {
+        uint64_t nl = 0, cm = 0;
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+            nl |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nlv)) << (16 * k);
+            cm |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cmv)) << (16 * k);
         }
-        frag = tasks[next_task++];
-        pthread_mutex_unlock(&task_mutex);
+        if ((bad = scan_masks(nl, cm, p, &rec, &commas))) return bad;
+    }
+    return scan_tail(p, end, rec, commas);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char *validate_block_avx2(const char *p, const char *end) {
+    const __m256i nlv = _mm256_set1_epi8('\n'), cmv = _mm256_set1_epi8(',');
+    const char *rec = p, *bad;
+    int commas = 0;
+    for (; end - p >= 64; p += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+        uint64_t nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nlv))
+                    | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nlv)) << 32;
+        uint64_t cm = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cmv))
+                    | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cmv)) << 32;
+        if ((bad = scan_masks(nl, cm, p, &rec, &commas))) return bad;
+    }
+    return scan_tail(p, end, rec, commas);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static const char *validate_block_avx512(const char *p, const char *end) {
+    const __m512i nlv = _mm512_set1_epi8('\n'), cmv = _mm512_set1_epi8(',');
+    const char *rec = p, *bad;
+    int commas = 0;
+    for (; end - p >= 64; p += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)p);
+        uint64_t nl = _mm512_cmpeq_epi8_mask(v, nlv);
+        uint64_t cm = _mm512_cmpeq_epi8_mask(v, cmv);
+        if ((bad = scan_masks(nl, cm, p, &rec, &commas))) return bad;
+    }
+    return scan_tail(p, end, rec, commas);
+}
+#endif
 
-        FILE *f = fopen(path, "r");
-        if (!f) continue;
+const char *(*validate_block)(const char *, const char *) = validate_block_scalar;
 
-        fseeko(f, frag.start, SEEK_SET);
+// Wybiera najszybszy wariant wyszukiwania dostępny na tym procesorze
+void simd_init(void) {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    find_newline = __builtin_cpu_supports("avx2") ? find_newline_avx2 : find_newline_sse2;
+    find_record_end = find_newline;
+    if (__builtin_cpu_supports("avx512bw"))
+        validate_block = validate_block_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        validate_block = validate_block_avx2;
+    else
+        validate_block = validate_block_sse2;
+#endif
+}
 
-        char *line = NULL;
-        size_t len = 0;
-        ssize_t r;
-        long line_no = 0;
-        size_t read_bytes = 0;
+/* ===================== CYTOWANIE ===================== */
 
-        while ((r = getline(&line, &len, f)) != -1) {
-            read_bytes += r;
-            line_no++;
+// Tryb RFC 4180 (-q): pola w cudzysłowach mogą zawierać ',' i '\n', a "" oznacza
+// cudzysłów wewnątrz pola. Dla każdych 64 bajtów maska "wewnątrz cudzysłowu" to
+// prefiksowy XOR maski '"' - jedno mnożenie bez przeniesień (PCLMUL) przez same
+// jedynki - więc przecinki i '\n' w polach cytowanych znikają z masek bez pętli
+// po bajtach. Stan "w cudzysłowie" przechodzi między blokami jako przeniesienie.
 
-            if (!valid_csv_line(line)) {
-                pthread_mutex_lock(&active_mutex);
-                error_flag = 1;
-                error_line = line_no;
-                pthread_mutex_unlock(&active_mutex);
-                break;
-            }
-            list_push(local, line);
-            if (read_bytes >= frag.size) break;
+typedef struct {
+    uint64_t nl, cm, qt;    // maski '\n', ',' i '"'
+} csv_masks_t;
+
+int quoted = 0;
+
+static void csv_masks_scalar(const char *p, csv_masks_t *m) {
+    m->nl = m->cm = m->qt = 0;
+    for (int i = 0; i < 64; i++) {
+        m->nl |= (uint64_t)(p[i] == '\n') << i;
+        m->cm |= (uint64_t)(p[i] == ',') << i;
+        m->qt |= (uint64_t)(p[i] == '"') << i;
+    }
+}
+
+// Prefiksowy XOR przesunięciami (6 kroków) - gdy brak PCLMUL
+static uint64_t prefix_xor_shift(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+#ifdef __x86_64__
+static inline void csv_masks_sse2(const char *p, csv_masks_t *m) {
+    const __m128i nlv = _mm_set1_epi8('\n'), cmv = _mm_set1_epi8(','), qtv = _mm_set1_epi8('"');
+    m->nl = m->cm = m->qt = 0;
+    for (int k = 0; k < 4; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+        m->nl |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nlv)) << (16 * k);
+        m->cm |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cmv)) << (16 * k);
+        m->qt |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, qtv)) << (16 * k);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void csv_masks_avx2(const char *p, csv_masks_t *m) {
+    const __m256i nlv = _mm256_set1_epi8('\n'), cmv = _mm256_set1_epi8(','), qtv = _mm256_set1_epi8('"');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    m->nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nlv))
+          | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nlv)) << 32;
+    m->cm = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cmv))
+          | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cmv)) << 32;
+    m->qt = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, qtv))
+          | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, qtv)) << 32;
+}
+
+__attribute__((target("pclmul,sse2")))
+static inline uint64_t prefix_xor_clmul(uint64_t x) {
+    __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, x), _mm_set1_epi8((char)0xFF), 0);
+    return _mm_cvtsi128_si64(r);
+}
+#endif
+
+void (*csv_masks)(const char *, csv_masks_t *) = csv_masks_scalar;
+uint64_t (*prefix_xor)(uint64_t) = prefix_xor_shift;
+
+// Maski dla [p, p + 64) albo krótszej końcówki dopełnionej zerami
+static inline void load_masks(const char *p, const char *end, csv_masks_t *m) {
+    if (end - p >= 64) {
+        csv_masks(p, m);
+    } else {
+        char buf[64] = {0};
+        memcpy(buf, p, end - p);
+        csv_masks(buf, m);
+    }
+}
+
+// Szuka pierwszego '\n' poza cudzysłowem; inq mówi, czy p leży wewnątrz pola cytowanego
+const char *find_unquoted_newline(const char *p, const char *end, int inq) {
+    uint64_t carry = inq ? ~0ULL : 0;
+    for (; p < end; p += 64) {
+        csv_masks_t m;
+        load_masks(p, end, &m);
+        uint64_t in = prefix_xor(m.qt) ^ carry;
+        uint64_t nl = m.nl & ~in;
+        if (nl)
+            return p + __builtin_ctzll(nl);
+        carry = (uint64_t)((int64_t)in >> 63);
+    }
+    return NULL;
+}
+
+// Koniec rekordu w trybie -q; rekord bez '"' przed pierwszym '\n' (najczęstszy
+// przypadek) kończy się tam, gdzie w trybie zwykłym
+static const char *find_record_end_quoted(const char *p, const char *end) {
+    const char *nl = find_newline(p, end);
+    if (!memchr(p, '"', (nl ? nl : end) - p))
+        return nl;
+    return find_unquoted_newline(p, end, 0);
+}
+
+// Koniec rekordu zaczynającego się w p przy kolejnych wywołaniach na tym samym
+// zakresie: *next_quote (NULL na starcie) pamięta pozycję następnego '"', więc w
+// trybie -q rekordy bez cudzysłowów kosztują tyle samo co w trybie zwykłym
+const char *next_record_end(const char *p, const char *end, const char **next_quote) {
+    const char *nl = find_newline(p, end);
+    if (!quoted)
+        return nl;
+    if (!*next_quote || *next_quote < p) {
+        const char *q = memchr(p, '"', end - p);
+        *next_quote = q ? q : end;
+    }
+    if ((nl ? nl : end) <= *next_quote)
+        return nl;
+    return find_unquoted_newline(p, end, 0);
+}
+
+// Liczy cudzysłowy w [p, end) - parzystość mówi, czy end leży w polu cytowanym
+static long count_quotes_scalar(const char *p, const char *end) {
+    long quotes = 0;
+    for (; p < end; p++)
+        quotes += *p == '"';
+    return quotes;
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2,popcnt")))
+static long count_quotes_avx2(const char *p, const char *end) {
+    const __m256i qtv = _mm256_set1_epi8('"');
+    long quotes = 0;
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        quotes += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, qtv)));
+    }
+    return quotes + count_quotes_scalar(p, end);
+}
+#endif
+
+long (*count_quotes)(const char *, const char *) = count_quotes_scalar;
+
+// Walidator trybu -q: przecinki i '\n' w cudzysłowach są maskowane przed zliczaniem,
+// a rekord z niezamkniętym cudzysłowem na końcu zakresu jest błędny.
+// Wspólne ciało jest wklejane w warianty z konkretnym budowaniem masek, żeby
+// maski i prefiksowy XOR zostały rozwinięte w miejscu zamiast wołane pośrednio.
+static inline __attribute__((always_inline))
+const char *validate_quoted_impl(const char *p, const char *end,
+                                 void (*masks)(const char *, csv_masks_t *),
+                                 uint64_t (*pxor)(uint64_t)) {
+    const char *rec = p, *bad;
+    int commas = 0;
+    uint64_t carry = 0;
+    csv_masks_t m;
+    for (; p < end; p += 64) {
+        if (end - p >= 64) {
+            masks(p, &m);
+        } else {
+            char buf[64] = {0};
+            memcpy(buf, p, end - p);
+            masks(buf, &m);
         }
+        uint64_t in = pxor(m.qt) ^ carry;
+        carry = (uint64_t)((int64_t)in >> 63);
+        if ((bad = scan_masks(m.nl & ~in, m.cm & ~in, p, &rec, &commas)))
+            return bad;
+    }
+    if (rec < end && (commas != 1 || carry))
+        return rec;
+    return NULL;
+}
+
+static const char *validate_block_quoted(const char *p, const char *end) {
+    return validate_quoted_impl(p, end, csv_masks, prefix_xor);
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2,pclmul,popcnt")))
+static const char *validate_block_quoted_avx2(const char *p, const char *end) {
+    return validate_quoted_impl(p, end, csv_masks_avx2, prefix_xor_clmul);
+}
+#endif
 
-        free(line);
-        fclose(f);
+// Włącza tryb cytowany: podmienia walidator i wyszukiwanie końca rekordu
+void quoted_init(void) {
+    quoted = 1;
+#ifdef __x86_64__
+    csv_masks = __builtin_cpu_supports("avx2") ? csv_masks_avx2 : csv_masks_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        count_quotes = count_quotes_avx2;
+    if (__builtin_cpu_supports("pclmul"))
+        prefix_xor = prefix_xor_clmul;
+#endif
+    validate_block = validate_block_quoted;
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul"))
+        validate_block = validate_block_quoted_avx2;
+#endif
+    find_record_end = find_record_end_quoted;
+}
 
-        if (error_flag) break;
+// Koniec ostatniego pełnego rekordu w buforze (NULL gdy nie ma żadnego)
+char *last_record_end(char *buf, size_t len) {
+    if (!quoted)
+        return memrchr(buf, '\n', len);
+    const char *p = buf, *end = buf + len, *last = NULL, *nl;
+    while ((nl = find_record_end(p, end))) {
+        last = nl;
+        p = nl + 1;
     }
+    return (char *)last;
+}
+
+// Zdejmuje zewnętrzne cudzysłowy z wartości pola (wnętrze zostaje bez zmian)
+line_t field_value(line_t f) {
+    if (quoted && f.len >= 2 && f.line[0] == '"' && f.line[f.len - 1] == '"')
+        return (line_t){f.line + 1, f.len - 2};
+    return f;
+}
 
-    pthread_mutex_lock(&active_mutex);
-    active_threads--;
-    pthread_mutex_unlock(&active_mutex);
+/* ===================== FRAGMENTY ===================== */
 
-    if (error_flag)
-        pthread_barrier_wait(&error_barrier);
+typedef struct {
+    const fragment_t *frags;
+    long *quotes;
+    int m;
+    atomic_int next;
+} quote_count_t;
 
+// Wątek pomocniczy podziału w trybie -q - liczy cudzysłowy w kolejnych wstępnych fragmentach
+void *quote_count_worker(void *arg) {
+    quote_count_t *qc = arg;
+    int i;
+    while ((i = atomic_fetch_add(&qc->next, 1)) < qc->m)
+        qc->quotes[i] = count_quotes(data + qc->frags[i].start,
+                                     data + qc->frags[i].start + qc->frags[i].size);
     return NULL;
 }
 
-/* ===================== MAIN ===================== */
+// Dzieli [data_start, data_len) na m fragmentów zaczynających się od początku linii.
+// Każda granica jest przesuwana za najbliższy '\n', więc fragmenty są rozłączne,
+// pokrywają cały zakres i żadna linia nie jest dzielona między dwa fragmenty.
+// W trybie -q n wątków najpierw liczy cudzysłowy w równych kawałkach; parzystość
+// sumy prefiksowej mówi, czy granica wypada w polu cytowanym, i wtedy szukany jest
+// pierwszy '\n' za końcem tego pola. Pliki do QUOTE_SERIAL_MAX bajtów są liczone
+// w wątku wywołującym - przy tysiącach małych plików (katalog) tworzenie wątków
+// dla każdego z nich kosztowałoby więcej niż samo liczenie.
+void split_fragments(fragment_t *frags, int m, off_t data_start, int n) {
+    off_t data_size = data_len - data_start;
+    off_t chunk = data_size / m;
+    off_t prev = data_start;
+    long *quotes = NULL;
 
-int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s n m path\n", argv[0]);
-        return 1;
+    if (quoted) {
+        for (int i = 0; i < m; i++) {
+            frags[i].start = data_start + i * chunk;
+            frags[i].size = (i == m - 1) ? data_size - i * chunk : chunk;
+        }
+        /* cudzysłowy w ostatnim kawałku nie wpływają na żadną granicę */
+        quote_count_t qc = {frags, calloc(m, sizeof(long)), m - 1, 0};
+        if (data_size <= QUOTE_SERIAL_MAX || n < 2 || m < 3) {
+            quote_count_worker(&qc);
+        } else {
+            if (n > m - 1)
+                n = m - 1;
+            pthread_t threads[n];
+            for (int i = 0; i < n; i++)
+                pthread_create(&threads[i], NULL, quote_count_worker, &qc);
+            for (int i = 0; i < n; i++)
+                pthread_join(threads[i], NULL);
+        }
+        quotes = qc.quotes;
+    }
+
+    long parity = 0;
+    for (int i = 0; i < m; i++) {
+        off_t s = data_start + i * chunk;
+        int inq = parity & 1;
+        if (quotes)
+            parity += quotes[i];
+        if (s <= prev) {
+            s = prev;
+        } else if (s < (off_t)data_len && (inq || data[s - 1] != '\n')) {
+            const char *nl = quoted ? find_unquoted_newline(data + s, data + data_len, inq)
+                                    : find_newline(data + s, data + data_len);
+            s = nl ? nl - data + 1 : (off_t)data_len;
+        }
+        frags[i].start = s;
+        prev = s;
+    }
+    for (int i = 0; i < m; i++) {
+        off_t next = (i == m - 1) ? (off_t)data_len : frags[i + 1].start;
+        frags[i].size = next - frags[i].start;
     }
+    free(quotes);
+}
 
-    int n = atoi(argv[1]);
-    int m = atoi(argv[2]);
-    path = argv[3];
+// Samokontrola podziału (-v): fragmenty leżą ciągiem, bez przerw i nakładania,
+// a każdy niepusty zaczyna się na początku rekordu - za '\n', a w trybie -q
+// dodatkowo poza polem cytowanym (parzysta liczba cudzysłowów przed nim).
+// Przy cover pokrywają dokładnie [data_start, data_len). Zwraca 0 albo -1
+int check_fragments(const char *path, const fragment_t *frags, int m, off_t data_start, int cover) {
+    off_t pos = frags[0].start;
+    long parity = quoted ? count_quotes(data + data_start, data + pos) : 0;
+    const char *why = NULL;
+    int i;
+    if (cover && pos != data_start)
+        why = "does not start at the first record";
+    for (i = 0; i < m && !why; i++) {
+        if (frags[i].start != pos)
+            why = frags[i].start < pos ? "overlaps the previous one" : "leaves a gap after the previous one";
+        else if (frags[i].start + (off_t)frags[i].size > (off_t)data_len)
+            why = "runs past the end of the data";
+        else if (frags[i].size && pos > data_start && (data[pos - 1] != '\n' || (parity & 1)))
+            why = "does not start at a record boundary";
+        if (why)
+            break;
+        if (quoted)
+            parity += count_quotes(data + pos, data + pos + frags[i].size);
+        pos += frags[i].size;
+    }
+    if (why) {
+        fprintf(stderr, "%s: fragment check failed: fragment %d %s\n", path, i < m ? i : 0, why);
+        return -1;
+    }
+    if (cover && pos != (off_t)data_len) {
+        fprintf(stderr, "%s: fragment check failed: fragments end at %lld of %zu bytes\n", path,
+                (long long)pos, data_len);
+        return -1;
+    }
+    fprintf(stderr, "stats: %s: %d fragments cover [%lld, %lld) exactly\n", path, m,
+            (long long)frags[0].start, (long long)pos);
+    return 0;
+}
 
-    FILE *f = fopen(path, "r");
-    if (!f) {
-        perror("fopen");
-        return 1;
+// Liczy linie w [p, end) (ostatnia może nie mieć '\n')
+long count_lines(const char *p, const char *end) {
+    long lines = 0;
+    const char *nq = NULL;
+    while (p < end) {
+        const char *nl = next_record_end(p, end, &nq);
+        lines++;
+        if (!nl) break;
+        p = nl + 1;
     }
+    return lines;
+}
 
-    /* nagłówek */
-    char *header = NULL;
-    size_t hlen = 0;
-    getline(&header, &hlen, f);
-    off_t data_start = ftello(f);
+/* ===================== INDEKS ===================== */
 
-    struct stat st;
-    stat(path, &st);
-    off_t data_size = st.st_size - data_start;
+// Plik obok wejścia (path.idx) z offsetami początków rekordów, żeby kolejne
+// uruchomienia nie szukały granic linii od nowa. Offsety są kodowane jako
+// różnice (varint LEB128) w blokach po IDX_BLOCK rekordów; każdy blok ma offset
+// bezwzględny pierwszego rekordu, pozycję w strumieniu i sumę kontrolną, więc
+// dowolny rekord da się odczytać po zdekodowaniu co najwyżej jednego bloku.
+// Indeks jest ważny tylko dla pliku o tym samym rozmiarze i mtime.
+
+#define IDX_MAGIC "T1IDX2\0"
+#define IDX_BLOCK 4096
+
+typedef struct {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t records;
+    uint64_t nblocks;
+    uint64_t stream_len;
+    uint64_t quoted;        // granice liczone w trybie -q
+} idx_header_t;
 
-    /* fragmenty */
-    tasks = calloc(m, sizeof(fragment_t));
-    size_t chunk = data_size / m;
+typedef struct {
+    uint64_t first_offset;
+    uint64_t stream_pos;
+    uint64_t checksum;
+} idx_block_t;
+
+typedef struct {
+    idx_header_t hdr;
+    idx_block_t *blocks;
+    unsigned char *stream;
+    void *map;              // mapowanie pliku indeksu albo NULL dla świeżo zbudowanego
+    size_t map_len;
+} line_index_t;
+
+// Suma kontrolna (FNV-1a) bloku: jego offset bezwzględny i strumień różnic
+static uint64_t idx_checksum(uint64_t first_offset, const unsigned char *p, size_t len) {
+    uint64_t h = (1469598103934665603ULL ^ first_offset) * 1099511628211ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+static size_t idx_block_end(const line_index_t *ix, uint64_t b) {
+    return b + 1 < ix->hdr.nblocks ? ix->blocks[b + 1].stream_pos : ix->hdr.stream_len;
+}
+
+// Zwraca offset początku rekordu k (k == records daje koniec danych)
+off_t idx_offset(const line_index_t *ix, uint64_t k) {
+    if (k >= ix->hdr.records)
+        return data_len;
+    const idx_block_t *b = &ix->blocks[k / IDX_BLOCK];
+    const unsigned char *p = ix->stream + b->stream_pos;
+    uint64_t off = b->first_offset;
+    for (uint64_t j = 0; j < k % IDX_BLOCK; j++) {
+        uint64_t d = 0;
+        int shift = 0;
+        do {
+            d |= (uint64_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        off += d;
+    }
+    return off;
+}
+
+// Buduje indeks jednym przebiegiem po zmapowanych danych
+void idx_build(line_index_t *ix, const struct stat *st, off_t data_start) {
+    size_t cap = 1 << 16, blocks_cap = 64;
+    memset(ix, 0, sizeof(*ix));
+    memcpy(ix->hdr.magic, IDX_MAGIC, 8);
+    ix->hdr.file_size = st->st_size;
+    ix->hdr.mtime_sec = st->st_mtim.tv_sec;
+    ix->hdr.mtime_nsec = st->st_mtim.tv_nsec;
+    ix->hdr.quoted = quoted;
+    ix->stream = malloc(cap);
+    ix->blocks = malloc(blocks_cap * sizeof(idx_block_t));
+    if (!ix->stream || !ix->blocks) {
+        perror("malloc");
+        exit(1);
+    }
+
+    const char *p = data + data_start, *end = data + data_len;
+    uint64_t prev = data_start;
+    while (p < end) {
+        uint64_t off = p - data;
+        if (ix->hdr.records % IDX_BLOCK == 0) {
+            if (ix->hdr.nblocks == blocks_cap) {
+                idx_block_t *blocks = realloc(ix->blocks, 2 * blocks_cap * sizeof(idx_block_t));
+                if (!blocks) {
+                    perror("realloc");
+                    exit(1);
+                }
+                ix->blocks = blocks;
+                blocks_cap *= 2;
+            }
+            ix->blocks[ix->hdr.nblocks].first_offset = off;
+            ix->blocks[ix->hdr.nblocks].stream_pos = ix->hdr.stream_len;
+            ix->hdr.nblocks++;
+        } else {
+            if (ix->hdr.stream_len + 10 > cap) {
+                unsigned char *stream = realloc(ix->stream, 2 * cap);
+                if (!stream) {
+                    perror("realloc");
+                    exit(1);
+                }
+                ix->stream = stream;
+                cap *= 2;
+            }
+            uint64_t d = off - prev;
+            do {
+                ix->stream[ix->hdr.stream_len++] = (d & 0x7f) | (d > 0x7f ? 0x80 : 0);
+                d >>= 7;
+            } while (d);
+        }
+        prev = off;
+        ix->hdr.records++;
+        const char *nl = find_record_end(p, end);
+        p = nl ? nl + 1 : end;
+    }
+    for (uint64_t b = 0; b < ix->hdr.nblocks; b++) {
+        size_t pos = ix->blocks[b].stream_pos;
+        ix->blocks[b].checksum = idx_checksum(ix->blocks[b].first_offset, ix->stream + pos,
+                                              idx_block_end(ix, b) - pos);
+    }
+}
+
+// Zapisuje indeks do pliku tymczasowego i podmienia go atomowo przez rename
+int idx_save(const line_index_t *ix, const char *idx_path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d", idx_path, getpid());
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    int ok = fwrite(&ix->hdr, sizeof(ix->hdr), 1, f) == 1
+          && fwrite(ix->blocks, sizeof(idx_block_t), ix->hdr.nblocks, f) == ix->hdr.nblocks
+          && fwrite(ix->stream, 1, ix->hdr.stream_len, f) == ix->hdr.stream_len;
+    if (fclose(f) || !ok || rename(tmp, idx_path)) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Mapuje istniejący indeks; zwraca -1 gdy go nie ma, jest nieaktualny albo uszkodzony
+int idx_load(line_index_t *ix, const char *idx_path, const struct stat *st) {
+    memset(ix, 0, sizeof(*ix));
+    int fd = open(idx_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat ist;
+    if (fstat(fd, &ist) < 0 || (size_t)ist.st_size < sizeof(idx_header_t)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    memcpy(&ix->hdr, map, sizeof(idx_header_t));
+    ix->map = map;
+    ix->map_len = ist.st_size;
+    ix->blocks = (idx_block_t *)((char *)map + sizeof(idx_header_t));
+    ix->stream = (unsigned char *)(ix->blocks + ix->hdr.nblocks);
+
+    int ok = !memcmp(ix->hdr.magic, IDX_MAGIC, 8)
+          && ix->hdr.file_size == (uint64_t)st->st_size
+          && ix->hdr.mtime_sec == st->st_mtim.tv_sec
+          && ix->hdr.mtime_nsec == st->st_mtim.tv_nsec
+          && ix->hdr.quoted == (uint64_t)quoted
+          && ix->hdr.nblocks == (ix->hdr.records + IDX_BLOCK - 1) / IDX_BLOCK
+          && sizeof(idx_header_t) + ix->hdr.nblocks * sizeof(idx_block_t) + ix->hdr.stream_len
+             == (uint64_t)ist.st_size;
+    for (uint64_t b = 0; ok && b < ix->hdr.nblocks; b++) {
+        size_t pos = ix->blocks[b].stream_pos, bend = idx_block_end(ix, b);
+        ok = pos <= bend && bend <= ix->hdr.stream_len
+          && ix->blocks[b].first_offset < data_len
+          && idx_checksum(ix->blocks[b].first_offset, ix->stream + pos, bend - pos)
+             == ix->blocks[b].checksum;
+    }
+    if (!ok) {
+        munmap(map, ist.st_size);
+        memset(ix, 0, sizeof(*ix));
+        return -1;
+    }
+    return 0;
+}
+
+// Wczytuje indeks dla path, a gdy jest nieaktualny - buduje go i zapisuje ponownie
+void idx_open(line_index_t *ix, const char *path, const struct stat *st, off_t data_start, int stats) {
+    char idx_path[PATH_MAX];
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    if (idx_load(ix, idx_path, st) == 0) {
+        if (stats)
+            fprintf(stderr, "stats: index %s loaded, records=%llu\n", idx_path,
+                    (unsigned long long)ix->hdr.records);
+        return;
+    }
+    idx_build(ix, st, data_start);
+    if (idx_save(ix, idx_path) < 0)
+        fprintf(stderr, "warning: cannot write index %s\n", idx_path);
+    else if (stats)
+        fprintf(stderr, "stats: index %s rebuilt, records=%llu\n", idx_path,
+                (unsigned long long)ix->hdr.records);
+}
+
+void idx_close(line_index_t *ix) {
+    if (ix->map) {
+        munmap(ix->map, ix->map_len);
+    } else {
+        free(ix->blocks);
+        free(ix->stream);
+    }
+}
+
+// Dzieli rekordy [first, last) na m fragmentów o równej liczbie rekordów
+void split_fragments_by_records(const line_index_t *ix, fragment_t *frags, int m,
+                                uint64_t first, uint64_t last) {
     for (int i = 0; i < m; i++) {
-        tasks[i].start = data_start + i * chunk;
-        tasks[i].size  = (i == m - 1) ? data_size - i * chunk : chunk;
+        off_t s = idx_offset(ix, first + (last - first) * i / m);
+        off_t e = idx_offset(ix, first + (last - first) * (i + 1) / m);
+        frags[i].start = s;
+        frags[i].size = e - s;
     }
-    task_count = m;
+}
 
-    fclose(f);
-    free(header);
+/* ===================== KOLUMNY ===================== */
 
-    pthread_barrier_init(&error_barrier, NULL, n);
-    active_threads = n;
+// Tryb kolumnowy (-a/-g): nagłówek wyznacza nazwy kolumn, a każdy fragment jest
+// rozkładany na tablice typowane - liczby jako int64_t, napisy jako widoki w pliku.
+// Agregacje liczą się potem równolegle bezpośrednio na tych tablicach.
 
-    pthread_t threads[n];
-    list_t lists[n];
+#define MAX_COLS 16
+#define INT_NULL INT64_MIN      // wartość nie będąca liczbą w kolumnie liczbowej
 
-    for (int i = 0; i < n; i++) {
-        list_init(&lists[i]);
-        pthread_create(&threads[i], NULL, worker, &lists[i]);
+typedef enum { COL_STR, COL_INT } col_type_t;
+
+typedef struct {
+    char name[64];
+    col_type_t type;
+} column_t;
+
+// Blok kolumn dla jednego bloku walidacji - każda kolumna to ciągła tablica rows elementów
+typedef struct colblock {
+    struct colblock *next;
+    long rows;
+    void *cols[MAX_COLS];       // int64_t[] albo line_t[] zależnie od typu kolumny
+} colblock_t;
+
+typedef struct {
+    colblock_t *head, *tail;
+} collist_t;
+
+column_t columns[MAX_COLS];
+int ncols;
+int columnar = 0;               // czy workerzy budują kolumny zamiast list linii
+int filtering = 0;              // czy rekordy przechodzą przez predykaty/projekcję
+int agg_col = -1, group_col = -1;
+collist_t *col_results;         // kolumny osobno dla każdego fragmentu
+
+// Dzieli rekord na pola (bez końcowego '\n'/'\r'); zwraca liczbę pól.
+// W trybie -q przecinki wewnątrz cudzysłowów nie rozdzielają pól.
+int split_fields(const char *p, size_t len, line_t *fields, int max) {
+    while (len && (p[len - 1] == '\n' || p[len - 1] == '\r'))
+        len--;
+    const char *end = p + len;
+    int k = 0;
+    while (k < max) {
+        const char *comma;
+        if (quoted && memchr(p, '"', end - p)) {
+            int inq = 0;
+            for (comma = p; comma < end && (inq || *comma != ','); comma++)
+                if (*comma == '"') inq = !inq;
+            if (comma == end) comma = NULL;
+        } else {
+            comma = memchr(p, ',', end - p);
+        }
+        fields[k].line = p;
+        fields[k].len = comma ? (size_t)(comma - p) : (size_t)(end - p);
+        k++;
+        if (!comma) break;
+        p = comma + 1;
     }
+    return k;
+}
 
-    for (int i = 0; i < n; i++)
-        pthread_join(threads[i], NULL);
+// Zamienia len <= 8 cyfr ASCII na liczbę techniką SWAR (trzy mnożenia zamiast pętli)
+static inline int parse_digits8(const char *p, size_t len, uint64_t *out) {
+    char buf[8] = {'0', '0', '0', '0', '0', '0', '0', '0'};
+    uint64_t v;
+    memcpy(buf + 8 - len, p, len);
+    memcpy(&v, buf, 8);
+    v -= 0x3030303030303030ULL;
+    if ((v | (v + 0x7676767676767676ULL)) & 0x8080808080808080ULL)
+        return 0;   // któryś bajt nie jest cyfrą
+    v = (v * 10) + (v >> 8);
+    v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    v = ((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+    *out = v;
+    return 1;
+}
 
-    if (error_flag) {
-        fprintf(stderr, "CSV error at line %ld\n", error_line);
-        return 1;
+// Parsuje liczbę całkowitą ze znakiem (do 16 cyfr - dwie porcje po 8); zwraca 0 gdy pole nie jest liczbą
+int parse_int(const char *p, size_t len, int64_t *out) {
+    int neg = 0;
+    if (len && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+        len--;
+    }
+    if (len == 0 || len > 16)
+        return 0;
+    uint64_t hi = 0, lo;
+    if (len > 8) {
+        if (!parse_digits8(p, len - 8, &hi))
+            return 0;
+        p += len - 8;
+        len = 8;
+        hi *= 100000000ULL;
     }
+    if (!parse_digits8(p, len, &lo))
+        return 0;
+    *out = neg ? -(int64_t)(hi + lo) : (int64_t)(hi + lo);
+    return 1;
+}
 
-    /* łączenie list */
-    list_t result;
-    list_init(&result);
-    for (int i = 0; i < n; i++)
-        list_append(&result, &lists[i]);
+// Czyta nazwy kolumn z nagłówka, a typy zgaduje z pierwszego rekordu danych
+int parse_header(const char *hdr, size_t hlen, const char *first, size_t flen) {
+    line_t f[MAX_COLS];
+    ncols = split_fields(hdr, hlen, f, MAX_COLS);
+    for (int i = 0; i < ncols; i++) {
+        line_t name = field_value(f[i]);
+        size_t l = name.len < sizeof(columns[i].name) ? name.len : sizeof(columns[i].name) - 1;
+        memcpy(columns[i].name, name.line, l);
+        columns[i].name[l] = '\0';
+        columns[i].type = COL_STR;
+    }
+    int k = first ? split_fields(first, flen, f, MAX_COLS) : 0;
+    for (int i = 0; i < k && i < ncols; i++) {
+        int64_t v;
+        line_t val = field_value(f[i]);
+        if (parse_int(val.line, val.len, &v))
+            columns[i].type = COL_INT;
+    }
+    return ncols;
+}
+
+// Zwraca numer kolumny o podanej nazwie albo -1
+int find_column(const char *name) {
+    for (int i = 0; i < ncols; i++)
+        if (!strcmp(columns[i].name, name))
+            return i;
+    return -1;
+}
+
+int row_matches(const line_t *f, int k);
 
-    /* druk */
-    for (node_t *p = result.head; p; p = p->next)
-        printf("%s", p->line);
+// Rozkłada rows rekordów z [p, end) na nowy blok kolumn w arenie wątku.
+// Przy aktywnych predykatach zapisywane są tylko pasujące wiersze.
+void columnar_parse(collist_t *cl, arena_t *a, const char *p, const char *end, long rows) {
+    if (rows == 0) return;
+    colblock_t *b = arena_alloc(a, sizeof(colblock_t));
+    b->next = NULL;
+    b->rows = rows;
+    for (int c = 0; c < ncols; c++)
+        b->cols[c] = arena_alloc(a, rows * (columns[c].type == COL_INT ? sizeof(int64_t) : sizeof(line_t)));
 
+    line_t f[MAX_COLS];
+    long r = 0;
+    const char *nq = NULL;
+    for (long i = 0; i < rows; i++) {
+        const char *nl = next_record_end(p, end, &nq);
+        size_t len = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+        int k = split_fields(p, len, f, MAX_COLS);
+        p += len;
+        if (filtering && !row_matches(f, k))
+            continue;
+        for (int c = 0; c < ncols; c++) {
+            line_t field = c < k ? field_value(f[c]) : (line_t){p, 0};
+            if (columns[c].type == COL_INT) {
+                int64_t v;
+                ((int64_t *)b->cols[c])[r] = parse_int(field.line, field.len, &v) ? v : INT_NULL;
+            } else {
+                ((line_t *)b->cols[c])[r] = field;
+            }
+        }
+        r++;
+    }
+    b->rows = r;
+
+    if (cl->tail) cl->tail->next = b;
+    else cl->head = b;
+    cl->tail = b;
+}
+
+/* ===================== FILTR ===================== */
+
+// Predykaty (-w) i projekcja (-c) są liczone w tym samym przebiegu co walidacja,
+// więc odrzucone wiersze nigdy nie trafiają do listy ani na wyjście.
+
+#define MAX_PREDS 8
+
+typedef enum { OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE } cmp_op_t;
+
+typedef struct {
+    int col;
+    cmp_op_t op;
+    int numeric;        // porównanie liczbowe gdy wartość jest liczbą, inaczej napisowe
+    int64_t num;
+    const char *str;
+    size_t len;
+} pred_t;
+
+pred_t preds[MAX_PREDS];
+int npreds;
+int proj[MAX_COLS];     // numery kolumn do wypisania, w zadanej kolejności
+int nproj;
+int sort_col = -1, uniq_col = -1;   // numery pól klucza w wypisywanym rekordzie
+
+// Parsuje predykat postaci kolumna<op>wartość, gdzie op to < <= > >= = == !=
+int parse_predicate(const char *spec, pred_t *pr) {
+    const char *op = strpbrk(spec, "<>=!");
+    if (!op || op == spec) return -1;
+
+    char name[sizeof(columns[0].name)];
+    size_t nlen = op - spec < (long)sizeof(name) ? (size_t)(op - spec) : sizeof(name) - 1;
+    memcpy(name, spec, nlen);
+    name[nlen] = '\0';
+    if ((pr->col = find_column(name)) < 0) return -1;
+
+    const char *val = op + 1;
+    if (op[0] == '<') pr->op = OP_LT;
+    else if (op[0] == '>') pr->op = OP_GT;
+    else if (op[0] == '=') pr->op = OP_EQ;
+    else if (op[0] == '!' && op[1] == '=') pr->op = OP_NE;
+    else return -1;
+    if (op[1] == '=') {
+        val++;
+        if (pr->op == OP_LT) pr->op = OP_LE;
+        else if (pr->op == OP_GT) pr->op = OP_GE;
+    }
+
+    pr->str = val;
+    pr->len = strlen(val);
+    pr->numeric = parse_int(val, pr->len, &pr->num);
+    return 0;
+}
+
+// Sprawdza warunek dla wyniku porównania c (<0, 0, >0)
+static int cmp_holds(cmp_op_t op, int c) {
+    switch (op) {
+    case OP_LT: return c < 0;
+    case OP_LE: return c <= 0;
+    case OP_GT: return c > 0;
+    case OP_GE: return c >= 0;
+    case OP_EQ: return c == 0;
+    case OP_NE: return c != 0;
+    }
     return 0;
 }
+
+// Zwraca 1 gdy rozłożony na pola rekord spełnia wszystkie predykaty
+int row_matches(const line_t *f, int k) {
+    for (int i = 0; i < npreds; i++) {
+        const pred_t *pr = &preds[i];
+        line_t field = pr->col < k ? field_value(f[pr->col]) : (line_t){"", 0};
+        int c;
+        if (pr->numeric) {
+            int64_t v;
+            if (!parse_int(field.line, field.len, &v)) return 0;
+            c = (v > pr->num) - (v < pr->num);
+        } else {
+            size_t l = field.len < pr->len ? field.len : pr->len;
+            c = memcmp(field.line, pr->str, l);
+            if (!c) c = (field.len > pr->len) - (field.len < pr->len);
+        }
+        if (!cmp_holds(pr->op, c)) return 0;
+    }
+    return 1;
+}
+
+// Składa rekord z wybranych kolumn w arenie i zwraca go jako widok
+line_t project_row(arena_t *a, const line_t *f, int k) {
+    size_t len = 1;
+    for (int i = 0; i < nproj; i++)
+        len += (proj[i] < k ? f[proj[i]].len : 0) + (i > 0);
+    char *out = arena_alloc(a, len), *q = out;
+    for (int i = 0; i < nproj; i++) {
+        if (i > 0) *q++ = ',';
+        if (proj[i] < k) {
+            memcpy(q, f[proj[i]].line, f[proj[i]].len);
+            q += f[proj[i]].len;
+        }
+    }
+    *q = '\n';
+    return (line_t){out, len};
+}
+
+// Kopia ostatniego rekordu pliku, który nie kończy się '\n', z dopisanym '\n' -
+// przy -S i -u rekordy zmieniają kolejność, więc nie mogą się sklejać
+line_t terminate_row(arena_t *a, line_t r) {
+    char *out = arena_alloc(a, r.len + 1);
+    memcpy(out, r.line, r.len);
+    out[r.len] = '\n';
+    return (line_t){out, r.len + 1};
+}
+
+// Numer pola kolumny name w wypisywanym rekordzie (po projekcji -c); -1 gdy go nie ma
+int output_column(const char *name) {
+    int c = find_column(name);
+    if (c < 0 || !nproj)
+        return c;
+    for (int j = 0; j < nproj; j++)
+        if (proj[j] == c)
+            return j;
+    return -1;
+}
+
+/* ===================== WORKER ===================== */
+
+// Zgłasza błąd we fragmencie idx pliku in - error_frag trzyma minimum po zgłoszeniach
+void report_error(input_t *in, int idx) {
+    int cur = atomic_load(&in->error_frag);
+    while (idx < cur && !atomic_compare_exchange_weak(&in->error_frag, &cur, idx))
+        ;
+}
+
+// Przetwarza jeden fragment pliku CSV: sprawdza poprawność linii i dodaje je
+// do listy fragmentu w arenie wątku
+void process_fragment(arena_t *arena, int idx) {
+    fragment_t *frag = &tasks[idx];
+    input_t *in = &inputs[frag->file];
+    /* fragmenty za pierwszym błędem pliku nie mają znaczenia, wcześniejsze
+       trzeba dokończyć; fragmenty innych plików idą dalej normalnie */
+    if (idx > atomic_load_explicit(&in->error_frag, memory_order_relaxed))
+        return;
+    list_t *local = &results[idx];
+
+    const char *p = in->data + frag->start;
+    const char *end = p + frag->size;
+    const char *bad = NULL;
+
+    /* fragment jest sprawdzany blokami po VALIDATE_BLOCK bajtów; między
+       blokami worker porzuca go, jeśli błąd pojawił się we wcześniejszym */
+    while (p < end && !bad) {
+        if (idx > atomic_load_explicit(&in->error_frag, memory_order_relaxed))
+            break;
+        const char *block_end = end;
+        if (end - p > VALIDATE_BLOCK) {
+            /* w trybie -q granica bloku musi leżeć poza polem cytowanym */
+            const char *nl = quoted && memchr(p, '"', VALIDATE_BLOCK)
+                ? find_unquoted_newline(p + VALIDATE_BLOCK, end, count_quotes(p, p + VALIDATE_BLOCK) & 1)
+                : find_newline(p + VALIDATE_BLOCK, end);
+            block_end = nl ? nl + 1 : end;
+        }
+
+        bad = validate_block(p, block_end);
+        const char *good_end = bad ? bad : block_end;
+
+        if (columnar) {
+            long rows = count_lines(p, good_end);
+            columnar_parse(&col_results[idx], arena, p, good_end, rows);
+            frag->lines += rows;
+            p = good_end;
+        }
+        const char *nq = NULL;
+        while (p < good_end) {
+            const char *nl = next_record_end(p, good_end, &nq);
+            size_t len = nl ? (size_t)(nl - p) + 1 : (size_t)(good_end - p);
+            frag->lines++;
+            line_t out = {p, len};
+            if (filtering) {
+                line_t f[MAX_COLS];
+                int k = split_fields(p, len, f, MAX_COLS);
+                if (row_matches(f, k)) {
+                    if (nproj)
+                        out = project_row(arena, f, k);
+                } else {
+                    out.len = 0;
+                }
+            }
+            if (out.len && out.line[out.len - 1] != '\n' && (sort_col >= 0 || uniq_col >= 0))
+                out = terminate_row(arena, out);
+            if (out.len)
+                list_push(local, arena, out.line, out.len);
+            p += len;
+        }
+    }
+
+    if (bad)
+        report_error(in, idx);
+}
+
+// Dobiera liczbę fragmentów pobieranych naraz (tryb auto) z czasu poprzedniego
+// pobrania: krótkie są zdominowane przez narzut kolejki, a długie psują
+// równowagę na końcu. Nigdy więcej niż 1/(2n) pozostałych fragmentów, żeby
+// ogon pracy rozłożył się na wszystkie wątki.
+int next_claim(int claim, long elapsed_ns) {
+    if (elapsed_ns < CLAIM_MIN_NS && claim < CLAIM_MAX)
+        claim *= 2;
+    else if (elapsed_ns > CLAIM_MAX_NS && claim > 1)
+        claim /= 2;
+    int left = (task_count - atomic_load_explicit(&next_task, memory_order_relaxed)) / (2 * worker_count);
+    return claim < left ? claim : (left > 1 ? left : 1);
+}
+
+// Funkcja wątku roboczego - pobiera kolejne fragmenty i przetwarza je po kolei
+void *worker(void *arg) {
+    arena_t *arena = arg;
+    int claim = 1;
+
+    while (1) {
+        /* bez blokady: każdy wątek rezerwuje sobie następne fragmenty atomowo,
+           więc wolniejsze fragmenty same rozkładają się na wolne wątki */
+        int idx = atomic_fetch_add_explicit(&next_task, claim, memory_order_relaxed);
+        if (idx >= task_count)
+            break;
+        int last = idx + claim < task_count ? idx + claim : task_count;
+        atomic_fetch_add_explicit(&claims, 1, memory_order_relaxed);
+
+        struct timespec t0, t1;
+        if (adaptive)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (; idx < last; idx++)
+            process_fragment(arena, idx);
+        if (adaptive) {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            claim = next_claim(claim, (t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec);
+        }
+    }
+
+    return NULL;
+}
+
+/* ===================== AGREGACJE ===================== */
+
+typedef struct {
+    long count, nulls;
+    int64_t sum, min, max;
+} agg_t;
+
+typedef struct {
+    const char *key;
+    size_t len;
+    agg_t agg;
+} group_t;
+
+// Tablica haszująca z adresowaniem otwartym - klucze to widoki w zmapowanym pliku
+typedef struct {
+    group_t *slots;
+    size_t cap, used;
+} group_table_t;
+
+typedef struct {
+    agg_t total;
+    group_table_t groups;
+} reducer_t;
+
+atomic_int next_reduce = 0;
+
+void agg_init(agg_t *g) {
+    memset(g, 0, sizeof(*g));
+    g->min = INT64_MAX;
+    g->max = INT64_MIN;
+}
+
+// Dolicza wartość (INT_NULL liczy się tylko jako wiersz)
+void agg_add(agg_t *g, int64_t v) {
+    g->count++;
+    if (v == INT_NULL) {
+        g->nulls++;
+        return;
+    }
+    g->sum += v;
+    if (v < g->min) g->min = v;
+    if (v > g->max) g->max = v;
+}
+
+void agg_merge(agg_t *dst, const agg_t *src) {
+    dst->count += src->count;
+    dst->nulls += src->nulls;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// Hash FNV-1a klucza grupy
+static uint64_t hash_key(const char *p, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+    return h;
+}
+
+// Zwraca grupę dla klucza, tworząc ją gdy jej nie ma (tablica rośnie przy zapełnieniu w połowie)
+group_t *group_find(group_table_t *t, const char *key, size_t len) {
+    if ((t->used + 1) * 2 > t->cap) {
+        group_table_t old = *t;
+        t->cap = old.cap ? old.cap * 2 : 64;
+        t->slots = calloc(t->cap, sizeof(group_t));
+        t->used = 0;
+        for (size_t i = 0; i < old.cap; i++)
+            if (old.slots[i].key) {
+                group_t *g = group_find(t, old.slots[i].key, old.slots[i].len);
+                g->agg = old.slots[i].agg;
+            }
+        free(old.slots);
+    }
+    size_t i = hash_key(key, len) & (t->cap - 1);
+    while (t->slots[i].key) {
+        if (t->slots[i].len == len && !memcmp(t->slots[i].key, key, len))
+            return &t->slots[i];
+        i = (i + 1) & (t->cap - 1);
+    }
+    t->slots[i].key = key;
+    t->slots[i].len = len;
+    agg_init(&t->slots[i].agg);
+    t->used++;
+    return &t->slots[i];
+}
+
+// Wątek redukcji - pobiera fragmenty atomowo i agreguje ich kolumny do lokalnego wyniku
+void *reduce_worker(void *arg) {
+    reducer_t *red = arg;
+    int idx;
+    while ((idx = atomic_fetch_add(&next_reduce, 1)) < task_count) {
+        if (inputs[tasks[idx].file].error_frag != INT_MAX)
+            continue;
+        for (colblock_t *b = col_results[idx].head; b; b = b->next) {
+            const int64_t *vals = agg_col >= 0 ? b->cols[agg_col] : NULL;
+            const line_t *keys = group_col >= 0 ? b->cols[group_col] : NULL;
+            for (long r = 0; r < b->rows; r++) {
+                int64_t v = vals ? vals[r] : INT_NULL;
+                if (keys)
+                    agg_add(&group_find(&red->groups, keys[r].line, keys[r].len)->agg, v);
+                else
+                    agg_add(&red->total, v);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int group_cmp(const void *a, const void *b) {
+    const group_t *x = a, *y = b;
+    size_t l = x->len < y->len ? x->len : y->len;
+    int c = memcmp(x->key, y->key, l);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+// Wypisuje wartość pola jako pole CSV. W trybie -q wartość z ',', '"' albo końcem
+// linii wraca do cudzysłowów - field_value zdjął tylko zewnętrzne, więc "" w
+// środku nadal jest w postaci RFC 4180 i wystarczy je z powrotem otoczyć
+void print_field(const char *p, size_t len) {
+    int quote = 0;
+    for (size_t i = 0; quoted && i < len && !quote; i++)
+        quote = p[i] == ',' || p[i] == '"' || p[i] == '\n' || p[i] == '\r';
+    if (quote)
+        printf("\"%.*s\"", (int)len, p);
+    else
+        printf("%.*s", (int)len, p);
+}
+
+// Wypisuje jeden wiersz wyniku agregacji
+void print_agg(const agg_t *g) {
+    printf("%ld", g->count);
+    if (agg_col < 0) {
+        printf("\n");
+        return;
+    }
+    long n = g->count - g->nulls;
+    if (n == 0)
+        printf(",0,,,\n");
+    else
+        printf(",%lld,%lld,%lld,%.3f\n", (long long)g->sum, (long long)g->min,
+               (long long)g->max, (double)g->sum / n);
+}
+
+// Uruchamia n wątków redukcji, łączy ich częściowe wyniki i wypisuje je jako CSV
+void run_aggregate(int n) {
+    pthread_t threads[n];
+    reducer_t reds[n];
+    for (int i = 0; i < n; i++) {
+        memset(&reds[i], 0, sizeof(reducer_t));
+        agg_init(&reds[i].total);
+        pthread_create(&threads[i], NULL, reduce_worker, &reds[i]);
+    }
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    const char *stats_hdr = agg_col >= 0 ? "count,sum,min,max,avg" : "count";
+    if (group_col < 0) {
+        agg_t total;
+        agg_init(&total);
+        for (int i = 0; i < n; i++)
+            agg_merge(&total, &reds[i].total);
+        printf("%s\n", stats_hdr);
+        print_agg(&total);
+        return;
+    }
+
+    group_table_t all = {0};
+    for (int i = 0; i < n; i++) {
+        for (size_t s = 0; s < reds[i].groups.cap; s++) {
+            group_t *g = &reds[i].groups.slots[s];
+            if (g->key)
+                agg_merge(&group_find(&all, g->key, g->len)->agg, &g->agg);
+        }
+        free(reds[i].groups.slots);
+    }
+
+    /* grupy posortowane po kluczu, żeby wynik nie zależał od podziału na wątki */
+    group_t *sorted = malloc((all.used ? all.used : 1) * sizeof(group_t));
+    if (!sorted) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t k = 0;
+    for (size_t s = 0; s < all.cap; s++)
+        if (all.slots[s].key)
+            sorted[k++] = all.slots[s];
+    qsort(sorted, k, sizeof(group_t), group_cmp);
+
+    print_field(columns[group_col].name, strlen(columns[group_col].name));
+    printf(",%s\n", stats_hdr);
+    for (size_t i = 0; i < k; i++) {
+        print_field(sorted[i].key, sorted[i].len);
+        putchar(',');
+        print_agg(&sorted[i].agg);
+    }
+    free(sorted);
+    free(all.slots);
+}
+
+/* ===================== WYJŚCIE ===================== */
+
+// Równoległy zapis wyniku w kolejności pliku. Każdy fragment zna rozmiar swojego
+// wyjścia (list_t.bytes), więc suma prefiksowa wyznacza jego offset w pliku
+// wyjściowym i wątki mogą pisać pwritev niezależnie. Potok dostaje vmsplice
+// (strony z mapowania bez kopiowania), a inne deskryptory zwykłe writev.
+// Przy wielu plikach wejściowych suma prefiksowa biegnie osobno dla każdego
+// deskryptora wyjścia: wspólny stdout dostaje pliki sklejone po kolei.
+
+#define IOV_BATCH 1024
+
+typedef enum { OUT_PWRITE, OUT_VMSPLICE, OUT_WRITEV } out_mode_t;
+
+off_t *out_offsets;
+atomic_int next_output = 0;
+atomic_int output_failed = 0;
+
+// Zapisuje całe iov, dokańczając częściowe zapisy; vmsplice odrzucony przez
+// jądro przełącza tryb na writev bez utraty już zapisanych bajtów
+int write_iov(int fd, struct iovec *iov, int cnt, off_t off, out_mode_t *mode) {
+    while (cnt > 0) {
+        ssize_t k;
+        if (*mode == OUT_PWRITE)
+            k = pwritev(fd, iov, cnt, off);
+        else if (*mode == OUT_VMSPLICE)
+            k = vmsplice(fd, iov, cnt, 0);
+        else
+            k = writev(fd, iov, cnt);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            if (*mode == OUT_VMSPLICE && (errno == EINVAL || errno == ENOSYS)) {
+                *mode = OUT_WRITEV;
+                continue;
+            }
+            return -1;
+        }
+        off += k;
+        while (cnt > 0 && (size_t)k >= iov->iov_len) {
+            k -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + k;
+            iov->iov_len -= k;
+        }
+    }
+    return 0;
+}
+
+// Zapisuje linie jednej listy do fd od offsetu off paczkami po IOV_BATCH widoków
+int write_list(int fd, const list_t *l, off_t off, out_mode_t *mode) {
+    struct iovec iov[IOV_BATCH];
+    int cnt = 0;
+    size_t batch = 0;
+    for (chunk_t *c = l->head; c; c = c->next) {
+        for (size_t i = 0; i < c->count; i++) {
+            iov[cnt].iov_base = (void *)c->lines[i].line;
+            iov[cnt].iov_len = c->lines[i].len;
+            batch += c->lines[i].len;
+            if (++cnt == IOV_BATCH) {
+                if (write_iov(fd, iov, cnt, off, mode) < 0) return -1;
+                off += batch;
+                cnt = 0;
+                batch = 0;
+            }
+        }
+    }
+    return cnt ? write_iov(fd, iov, cnt, off, mode) : 0;
+}
+
+// Zapisuje cnt linii z tablicy v do fd od offsetu off paczkami po IOV_BATCH widoków
+int write_lines(int fd, const line_t *v, size_t cnt, off_t off, out_mode_t *mode) {
+    struct iovec iov[IOV_BATCH];
+    while (cnt > 0) {
+        int k = cnt < IOV_BATCH ? cnt : IOV_BATCH;
+        size_t batch = 0;
+        for (int i = 0; i < k; i++) {
+            iov[i].iov_base = (void *)v[i].line;
+            iov[i].iov_len = v[i].len;
+            batch += v[i].len;
+        }
+        if (write_iov(fd, iov, k, off, mode) < 0)
+            return -1;
+        off += batch;
+        v += k;
+        cnt -= k;
+    }
+    return 0;
+}
+
+// Wątek zapisu - pobiera fragmenty atomowo i zapisuje je pod wyliczone offsety
+void *output_worker(void *arg) {
+    (void)arg;
+    out_mode_t mode = OUT_PWRITE;
+    int idx;
+    while ((idx = atomic_fetch_add(&next_output, 1)) < task_count) {
+        const input_t *in = &inputs[tasks[idx].file];
+        if (in->error_frag == INT_MAX && write_list(in->out_fd, &results[idx], out_offsets[idx], &mode) < 0)
+            atomic_store(&output_failed, 1);
+    }
+    return NULL;
+}
+
+// Ostatni bajt wyniku pliku; 0 gdy wynik jest pusty
+char output_last_byte(const input_t *in) {
+    for (int i = in->first_task + in->ntasks - 1; i >= in->first_task; i--) {
+        const chunk_t *c = results[i].tail;
+        if (c && c->count && c->lines[c->count - 1].len)
+            return c->lines[c->count - 1].line[c->lines[c->count - 1].len - 1];
+    }
+    return 0;
+}
+
+// Wypisuje wyniki fragmentów w kolejności plików do ich out_fd (domyślnie stdout);
+// pliki z błędem CSV są pomijane. Za wynikiem pliku, którego ostatni rekord nie
+// ma '\n', dopisuje '\n' tylko wtedy, gdy do tego samego fd trafia potem wynik
+// innego pliku - żeby rekordy się nie skleiły; ostatni wynik zostaje bez zmian
+int write_output(int n) {
+    fflush(stdout);
+    out_offsets = calloc(task_count ? task_count : 1, sizeof(off_t));
+    if (!out_offsets) {
+        perror("calloc");
+        return -1;
+    }
+
+    /* od końca: 1 gdy za wynikiem bez '\n' jest jeszcze niepusty wynik w tym samym fd */
+    int next_fd = -1;
+    for (int f = input_count - 1; f >= 0; f--) {
+        input_t *in = &inputs[f];
+        char last = in->error_frag == INT_MAX ? output_last_byte(in) : 0;
+        in->newline_at = last && last != '\n' && in->out_fd == next_fd ? 1 : -1;
+        if (last)
+            next_fd = in->out_fd;
+    }
+
+    /* offsety z sumy prefiksowej; równoległe pwritev tylko gdy każde wyjście
+       jest zwykłym plikiem bez O_APPEND */
+    int parallel = 1, fd = -1;
+    off_t off = 0;
+    for (int f = 0; f < input_count; f++) {
+        input_t *in = &inputs[f];
+        int failed = in->error_frag != INT_MAX;
+        if (!failed && in->out_fd != fd) {
+            struct stat st;
+            if (fd >= 0)
+                lseek(fd, off, SEEK_SET);
+            fd = in->out_fd;
+            if (fstat(fd, &st) < 0) {
+                perror("fstat");
+                free(out_offsets);
+                return -1;
+            }
+            off = lseek(fd, 0, SEEK_CUR);
+            if (!S_ISREG(st.st_mode) || off < 0 || (fcntl(fd, F_GETFL) & O_APPEND))
+                parallel = 0;
+        }
+        for (int i = in->first_task; !failed && i < in->first_task + in->ntasks; i++) {
+            out_offsets[i] = off;
+            off += results[i].bytes;
+        }
+        if (in->newline_at > 0)
+            in->newline_at = off++;
+    }
+
+    if (parallel) {
+        pthread_t threads[n];
+        for (int i = 0; i < n; i++)
+            pthread_create(&threads[i], NULL, output_worker, NULL);
+        for (int i = 0; i < n; i++)
+            pthread_join(threads[i], NULL);
+        for (int f = 0; f < input_count; f++)
+            if (inputs[f].newline_at >= 0 && pwrite(inputs[f].out_fd, "\n", 1, inputs[f].newline_at) != 1)
+                atomic_store(&output_failed, 1);
+        free(out_offsets);
+        if (fd >= 0)
+            lseek(fd, off, SEEK_SET);
+        if (output_failed) {
+            perror("pwritev");
+            return -1;
+        }
+        return 0;
+    }
+
+    /* potok albo terminal: jeden strumień, ale po IOV_BATCH linii na wywołanie */
+    out_mode_t mode = OUT_WRITEV;
+    fd = -1;
+    for (int i = 0; i < task_count; i++) {
+        input_t *in = &inputs[tasks[i].file];
+        if (in->error_frag != INT_MAX)
+            continue;
+        if (in->out_fd != fd) {
+            struct stat st;
+            fd = in->out_fd;
+            mode = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) ? OUT_VMSPLICE : OUT_WRITEV;
+        }
+        int last = i == in->first_task + in->ntasks - 1;
+        if (write_list(fd, &results[i], 0, &mode) < 0 ||
+            (last && in->newline_at >= 0 && TEMP_FAILURE_RETRY(write(fd, "\n", 1)) != 1)) {
+            perror("write");
+            free(out_offsets);
+            return -1;
+        }
+    }
+    free(out_offsets);
+    return 0;
+}
+
+/* ===================== SORTOWANIE ===================== */
+
+// Sortowanie (-S) i usuwanie duplikatów (-u) wyniku bez kopiowania rekordów.
+// Każdy rekord dostaje element z kluczem, widokiem na rekord i numerem seq
+// (kolejność w wejściu). Duplikaty odsiewa współbieżny zbiór haszujący, w którym
+// dla każdego klucza wygrywa najmniejszy seq. Przebiegi (jeden na fragment) są
+// sortowane osobno - klucze liczbowe pozycyjnie (radix), tekstowe qsort po
+// 8-bajtowym prefiksie - a potem n wątków scala je wielodrogowo, każdy swój
+// przedział kluczy wyznaczony z próbek. Bajty rekordów są czytane dopiero przy
+// końcowym zapisie.
+
+#define SORT_SAMPLES 8      // próbek z przebiegu do wyznaczenia granic scalania
+#define SEQ_DROPPED UINT64_MAX
+
+typedef struct {
+    uint64_t prefix;    // liczba z odwróconym bitem znaku albo 8 bajtów tekstu big-endian
+    line_t key;
+    line_t rec;
+    uint64_t seq;       // pozycja w wejściu; SEQ_DROPPED dla duplikatu
+} sort_item_t;
+
+// Przedział wyniku zapisywany przez jeden wątek
+typedef struct {
+    size_t begin, count, bytes;
+    off_t off;
+} slice_t;
+
+int sort_numeric;
+
+sort_item_t *items;
+size_t *run_start, *run_len;        // przebieg = elementy jednego fragmentu
+_Atomic uint64_t *uniq_set;         // seq + 1 pierwszego rekordu z kluczem, 0 = wolne
+size_t uniq_cap;
+sort_item_t *splitters;
+line_t *sorted;                     // widoki rekordów w kolejności wyniku
+slice_t *slices;
+int slice_count;
+atomic_int next_run;
+
+// Zwraca pole col rekordu (puste, gdy rekord ma mniej pól)
+line_t record_field(line_t rec, int col) {
+    line_t f[MAX_COLS];
+    int k = split_fields(rec.line, rec.len, f, col + 1);
+    return col < k ? f[col] : (line_t){rec.line, 0};
+}
+
+static int item_cmp(const void *x, const void *y) {
+    const sort_item_t *a = x, *b = y;
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    if (!sort_numeric) {
+        if (a->key.len > 8 && b->key.len > 8) {
+            size_t l = (a->key.len < b->key.len ? a->key.len : b->key.len) - 8;
+            int c = memcmp(a->key.line + 8, b->key.line + 8, l);
+            if (c)
+                return c;
+        }
+        if (a->key.len != b->key.len)
+            return a->key.len < b->key.len ? -1 : 1;
+    }
+    return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+// Uruchamia fn w n wątkach, które pobierają kolejne przebiegi z next_run
+void sort_phase(int n, void *(*fn)(void *)) {
+    pthread_t threads[n];
+    atomic_store(&next_run, 0);
+    for (int i = 0; i < n; i++)
+        pthread_create(&threads[i], NULL, fn, NULL);
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// Faza 1: elementy przebiegu z listy wyników fragmentu, w kolejności wejścia
+void *sort_build_worker(void *arg) {
+    (void)arg;
+    int r;
+    while ((r = atomic_fetch_add(&next_run, 1)) < task_count) {
+        sort_item_t *it = items + run_start[r];
+        for (chunk_t *c = results[r].head; c && run_len[r]; c = c->next) {
+            for (size_t i = 0; i < c->count; i++, it++) {
+                it->rec = c->lines[i];
+                it->seq = it - items;
+                if (sort_col < 0)
+                    continue;
+                it->key = record_field(it->rec, sort_col);
+                int64_t v;
+                if (sort_numeric) {
+                    if (!parse_int(it->key.line, it->key.len, &v))
+                        v = INT_NULL;
+                    it->prefix = (uint64_t)v ^ (1ULL << 63);
+                } else {
+                    it->prefix = 0;
+                    for (size_t b = 0; b < 8; b++)
+                        it->prefix = it->prefix << 8 | (b < it->key.len ? (unsigned char)it->key.line[b] : 0);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Szuka w zbiorze slotu klucza rekordu seq; wstawia go, jeśli klucza nie ma,
+// a przy istniejącym zostawia mniejszy seq. Klucz zajętego slotu jest czytany
+// z rekordu, którego seq slot przechowuje.
+void uniq_insert(uint64_t seq) {
+    line_t k = record_field(items[seq].rec, uniq_col);
+    size_t i = hash_key(k.line, k.len) & (uniq_cap - 1);
+    uint64_t me = seq + 1, cur = atomic_load(&uniq_set[i]);
+    while (1) {
+        if (!cur) {
+            if (atomic_compare_exchange_weak(&uniq_set[i], &cur, me))
+                return;
+            continue;
+        }
+        line_t o = record_field(items[cur - 1].rec, uniq_col);
+        if (o.len == k.len && !memcmp(o.line, k.line, k.len)) {
+            while (me < cur && !atomic_compare_exchange_weak(&uniq_set[i], &cur, me))
+                ;
+            return;
+        }
+        i = (i + 1) & (uniq_cap - 1);
+        cur = atomic_load(&uniq_set[i]);
+    }
+}
+
+// Faza 2 (-u): wstawianie kluczy wszystkich rekordów do zbioru
+void *uniq_insert_worker(void *arg) {
+    (void)arg;
+    int r;
+    while ((r = atomic_fetch_add(&next_run, 1)) < task_count)
+        for (size_t i = run_start[r]; i < run_start[r] + run_len[r]; i++)
+            uniq_insert(i);
+    return NULL;
+}
+
+// Faza 3 (-u): rekordy, które nie są pierwsze ze swoim kluczem, dostają SEQ_DROPPED
+void *uniq_mark_worker(void *arg) {
+    (void)arg;
+    int r;
+    while ((r = atomic_fetch_add(&next_run, 1)) < task_count) {
+        for (size_t s = run_start[r]; s < run_start[r] + run_len[r]; s++) {
+            line_t k = record_field(items[s].rec, uniq_col);
+            size_t i = hash_key(k.line, k.len) & (uniq_cap - 1);
+            uint64_t cur;
+            while (1) {
+                cur = atomic_load(&uniq_set[i]);
+                line_t o = record_field(items[cur - 1].rec, uniq_col);
+                if (o.len == k.len && !memcmp(o.line, k.line, k.len))
+                    break;
+                i = (i + 1) & (uniq_cap - 1);
+            }
+            if (cur != s + 1)
+                items[s].seq = SEQ_DROPPED;
+        }
+    }
+    return NULL;
+}
+
+// Sortuje przebieg stabilnie po kluczu liczbowym: LSD radix po 16 bitów,
+// z pominięciem cyfr, które mają wszystkie elementy takie same
+void radix_sort(sort_item_t *a, size_t len) {
+    sort_item_t *tmp = malloc(len * sizeof(sort_item_t));
+    size_t *count = malloc(65536 * sizeof(size_t));
+    if (!tmp || !count) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int shift = 0; shift < 64; shift += 16) {
+        memset(count, 0, 65536 * sizeof(size_t));
+        for (size_t i = 0; i < len; i++)
+            count[(a[i].prefix >> shift) & 0xFFFF]++;
+        if (count[(a[0].prefix >> shift) & 0xFFFF] == len)
+            continue;
+        size_t sum = 0;
+        for (int d = 0; d < 65536; d++) {
+            size_t c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < len; i++)
+            tmp[count[(a[i].prefix >> shift) & 0xFFFF]++] = a[i];
+        memcpy(a, tmp, len * sizeof(sort_item_t));
+    }
+    free(count);
+    free(tmp);
+}
+
+// Faza 4: usunięcie odrzuconych duplikatów z przebiegu i jego sortowanie
+void *sort_run_worker(void *arg) {
+    (void)arg;
+    int r;
+    while ((r = atomic_fetch_add(&next_run, 1)) < task_count) {
+        sort_item_t *a = items + run_start[r];
+        size_t k = 0;
+        for (size_t i = 0; i < run_len[r]; i++)
+            if (a[i].seq != SEQ_DROPPED)
+                a[k++] = a[i];
+        run_len[r] = k;
+        if (sort_col < 0 || k < 2)
+            continue;
+        if (sort_numeric)
+            radix_sort(a, k);
+        else
+            qsort(a, k, sizeof(sort_item_t), item_cmp);
+    }
+    return NULL;
+}
+
+// Pierwszy element przebiegu nie mniejszy niż key
+size_t lower_bound(const sort_item_t *a, size_t len, const sort_item_t *key) {
+    size_t lo = 0, hi = len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (item_cmp(&a[mid], key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Faza 5 (-S): wątek t scala przedział [splitters[t-1], splitters[t]) ze wszystkich
+// przebiegów kopcem głów przebiegów; pozycja w wyniku to liczba mniejszych elementów
+void *merge_worker(void *arg) {
+    slice_t *sl = arg;
+    int t = sl - slices;
+    size_t *pos = malloc(task_count * sizeof(size_t)), *end = malloc(task_count * sizeof(size_t));
+    int *heap = malloc(task_count * sizeof(int)), h = 0;
+    if (!pos || !end || !heap) {
+        perror("malloc");
+        exit(1);
+    }
+
+    sl->begin = sl->count = sl->bytes = 0;
+    for (int r = 0; r < task_count; r++) {
+        const sort_item_t *a = items + run_start[r];
+        pos[r] = t ? lower_bound(a, run_len[r], &splitters[t - 1]) : 0;
+        end[r] = t < slice_count - 1 ? lower_bound(a, run_len[r], &splitters[t]) : run_len[r];
+        sl->begin += pos[r];
+        sl->count += end[r] - pos[r];
+    }
+
+#define HEAD(r) (&items[run_start[r] + pos[r]])
+#define LESS(x, y) (item_cmp(HEAD(heap[x]), HEAD(heap[y])) < 0)
+    for (int r = 0; r < task_count; r++) {
+        if (pos[r] == end[r])
+            continue;
+        int i = h++;
+        heap[i] = r;
+        while (i > 0 && LESS(i, (i - 1) / 2)) {
+            int p = (i - 1) / 2, tmp = heap[i];
+            heap[i] = heap[p];
+            heap[p] = tmp;
+            i = p;
+        }
+    }
+    line_t *out = sorted + sl->begin;
+    while (h > 0) {
+        int r = heap[0];
+        *out++ = HEAD(r)->rec;
+        sl->bytes += HEAD(r)->rec.len;
+        if (++pos[r] == end[r])
+            heap[0] = heap[--h];
+        for (int i = 0;;) {
+            int l = 2 * i + 1, m = i;
+            if (l < h && LESS(l, m)) m = l;
+            if (l + 1 < h && LESS(l + 1, m)) m = l + 1;
+            if (m == i) break;
+            int tmp = heap[i];
+            heap[i] = heap[m];
+            heap[m] = tmp;
+            i = m;
+        }
+    }
+#undef LESS
+#undef HEAD
+
+    free(heap);
+    free(end);
+    free(pos);
+    return NULL;
+}
+
+// Faza 5 (bez -S): przebiegi po odsianiu duplikatów idą do wyniku w kolejności wejścia
+void *gather_worker(void *arg) {
+    (void)arg;
+    int r;
+    while ((r = atomic_fetch_add(&next_run, 1)) < task_count) {
+        slice_t *sl = &slices[r];
+        sl->bytes = 0;
+        for (size_t i = 0; i < sl->count; i++) {
+            sorted[sl->begin + i] = items[run_start[r] + i].rec;
+            sl->bytes += items[run_start[r] + i].rec.len;
+        }
+    }
+    return NULL;
+}
+
+// Faza 6: zapis przedziałów wyniku pod ich offsety
+void *slice_write_worker(void *arg) {
+    (void)arg;
+    out_mode_t mode = OUT_PWRITE;
+    int i;
+    while ((i = atomic_fetch_add(&next_run, 1)) < slice_count)
+        if (write_lines(STDOUT_FILENO, sorted + slices[i].begin, slices[i].count, slices[i].off, &mode) < 0)
+            atomic_store(&output_failed, 1);
+    return NULL;
+}
+
+// Sortuje i/lub odsiewa duplikaty rekordów ze wszystkich fragmentów i wypisuje
+// wynik na stdout
+int run_sort(int n) {
+    size_t total = 0;
+    run_start = calloc(task_count + 1, sizeof(size_t));
+    run_len = calloc(task_count + 1, sizeof(size_t));
+    for (int r = 0; r < task_count; r++) {
+        run_start[r] = total;
+        if (inputs[tasks[r].file].error_frag == INT_MAX)
+            for (chunk_t *c = results[r].head; c; c = c->next)
+                run_len[r] += c->count;
+        total += run_len[r];
+    }
+    items = malloc((total ? total : 1) * sizeof(sort_item_t));
+    sorted = malloc((total ? total : 1) * sizeof(line_t));
+    if (!items || !sorted) {
+        perror("malloc");
+        exit(1);
+    }
+    sort_phase(n, sort_build_worker);
+
+    if (uniq_col >= 0) {
+        for (uniq_cap = 16; uniq_cap < 2 * total; uniq_cap *= 2)
+            ;
+        uniq_set = calloc(uniq_cap, sizeof(*uniq_set));
+        if (!uniq_set) {
+            perror("calloc");
+            exit(1);
+        }
+        sort_phase(n, uniq_insert_worker);
+        sort_phase(n, uniq_mark_worker);
+        free(uniq_set);
+    }
+    sort_phase(n, sort_run_worker);
+
+    if (sort_col >= 0) {
+        /* granice przedziałów scalania z posortowanej próbki przebiegów */
+        size_t ns = 0;
+        sort_item_t *sample = malloc((task_count * SORT_SAMPLES + 1) * sizeof(sort_item_t));
+        if (!sample) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int r = 0; r < task_count; r++)
+            for (int j = 0; j < SORT_SAMPLES && run_len[r]; j++)
+                sample[ns++] = items[run_start[r] + run_len[r] * j / SORT_SAMPLES];
+        qsort(sample, ns, sizeof(sort_item_t), item_cmp);
+        slice_count = n;
+        splitters = malloc(n * sizeof(sort_item_t));
+        for (int t = 0; t < n - 1; t++)
+            splitters[t] = ns ? sample[ns * (t + 1) / n] : (sort_item_t){0};
+        free(sample);
+
+        slices = calloc(n, sizeof(slice_t));
+        pthread_t threads[n];
+        for (int t = 0; t < n; t++)
+            pthread_create(&threads[t], NULL, merge_worker, &slices[t]);
+        for (int t = 0; t < n; t++)
+            pthread_join(threads[t], NULL);
+        free(splitters);
+    } else {
+        slice_count = task_count;
+        slices = calloc(task_count + 1, sizeof(slice_t));
+        size_t k = 0;
+        for (int r = 0; r < task_count; r++) {
+            slices[r].begin = k;
+            slices[r].count = run_len[r];
+            k += run_len[r];
+        }
+        sort_phase(n, gather_worker);
+    }
+
+    /* zapis jak w write_output: równolegle pod offsety z sumy prefiksowej,
+       gdy stdout jest zwykłym plikiem, inaczej jednym strumieniem */
+    struct stat st = {0};
+    int ret = 0;
+    fflush(stdout);
+    off_t off = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode) && off >= 0
+        && !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND)) {
+        for (int i = 0; i < slice_count; i++) {
+            slices[i].off = off;
+            off += slices[i].bytes;
+        }
+        sort_phase(n, slice_write_worker);
+        lseek(STDOUT_FILENO, off, SEEK_SET);
+        if (output_failed) {
+            perror("pwritev");
+            ret = -1;
+        }
+    } else {
+        out_mode_t mode = S_ISFIFO(st.st_mode) ? OUT_VMSPLICE : OUT_WRITEV;
+        for (int i = 0; i < slice_count && !ret; i++)
+            if (write_lines(STDOUT_FILENO, sorted + slices[i].begin, slices[i].count, 0, &mode) < 0) {
+                perror("write");
+                ret = -1;
+            }
+    }
+
+    free(slices);
+    free(sorted);
+    free(items);
+    free(run_len);
+    free(run_start);
+    return ret;
+}
+
+/* ===================== STRUMIEŃ ===================== */
+
+// Tryb strumieniowy: czytelnik wypełnia pierścień bloków pełnymi liniami,
+// walidatory sprawdzają bloki równolegle, a emiter (wątek główny) wypisuje
+// je ściśle po kolei. Pamięć ogranicza liczba bloków razy rozmiar bloku.
+// W trybie -f koniec pliku nie kończy pracy: czytelnik oddaje blok z pełnymi
+// rekordami, które już są, i czeka (inotify) na dopisanie kolejnych.
+
+typedef enum { BLOCK_FREE, BLOCK_FILLED, BLOCK_BUSY, BLOCK_DONE } block_state_t;
+
+typedef struct {
+    char *buf;
+    size_t cap, len;
+    block_state_t state;
+    const char *bad;    // pierwszy błędny rekord w bloku albo NULL
+} block_t;
+
+typedef struct {
+    int fd;
+    int inotify;                     // obserwacja pliku w trybie -f, inaczej -1
+    block_t *blocks;
+    int count;
+    long filled, claimed, emitted;   // liczniki kolejnych bloków dla czytelnika, walidatorów i emitera
+    int eof, stop;
+    char *carry;                     // niepełna ostatnia linia przenoszona do następnego bloku
+    size_t carry_len, carry_cap;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ring_t;
+
+// Czeka na zmianę śledzonego pliku. Zwraca 0 po dopisaniu, 1 gdy plik został
+// obcięty (czytanie zaczyna się od nowa) i -1 gdy plik usunięto lub przeniesiono.
+int wait_append(ring_t *r) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    ssize_t k = TEMP_FAILURE_RETRY(read(r->inotify, buf, sizeof(buf)));
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if (k <= 0) {
+        if (k < 0) perror("inotify");
+        return -1;
+    }
+    for (char *p = buf; p < buf + k; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        if (((struct inotify_event *)p)->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            return -1;
+
+    /* otwarty deskryptor trzyma usunięty plik, więc IN_DELETE_SELF nie przyjdzie -
+       usunięcie widać jako IN_ATTRIB z zerową liczbą dowiązań */
+    struct stat st;
+    off_t pos = lseek(r->fd, 0, SEEK_CUR);
+    if (fstat(r->fd, &st) < 0 || st.st_nlink == 0)
+        return -1;
+    if (st.st_size < pos) {
+        fprintf(stderr, "file truncated, following from the start\n");
+        lseek(r->fd, 0, SEEK_SET);
+        return 1;
+    }
+    return 0;
+}
+
+// Wątek czytający - dzieli wejście na bloki kończące się na '\n' i pomija nagłówek.
+// Anulowanie jest dozwolone tylko w read() i w oczekiwaniu na inotify, żeby emiter
+// mógł przerwać blokujący odczyt z potoku.
+void *stream_reader(void *arg) {
+    ring_t *r = arg;
+    int header = 1, eof = 0;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (!eof) {
+        pthread_mutex_lock(&r->mutex);
+        block_t *b = &r->blocks[r->filled % r->count];
+        while (b->state != BLOCK_FREE && !r->stop)
+            pthread_cond_wait(&r->cond, &r->mutex);
+        int stop = r->stop;
+        pthread_mutex_unlock(&r->mutex);
+        if (stop) break;
+
+        if (r->carry_len > b->cap) {
+            /* resztę powiększonego bloku przejmuje blok, który może być mniejszy */
+            char *grown = realloc(b->buf, r->carry_len);
+            if (!grown) {
+                perror("realloc");
+                exit(1);
+            }
+            b->buf = grown;
+            b->cap = r->carry_len;
+        }
+        if (r->carry_len)
+            memcpy(b->buf, r->carry, r->carry_len);
+        b->len = r->carry_len;
+        r->carry_len = 0;
+        int idle = 0;   // -f: przeczytano wszystko, co jest w pliku
+
+        while (1) {
+            if (!eof && !idle && b->len < b->cap) {
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+                ssize_t k = TEMP_FAILURE_RETRY(read(r->fd, b->buf + b->len, b->cap - b->len));
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+                if (k < 0) perror("read");
+                if (k > 0) b->len += k;
+                else if (k == 0 && r->inotify >= 0) idle = 1;
+                else eof = 1;
+                continue;
+            }
+            if (idle && !(header ? find_record_end(b->buf, b->buf + b->len)
+                                 : last_record_end(b->buf, b->len))) {
+                /* nie ma jeszcze pełnego rekordu - czekanie na dopisanie */
+                int w = wait_append(r);
+                if (w < 0) {
+                    eof = 1;
+                } else if (w > 0) {
+                    b->len = 0;
+                    header = 1;
+                }
+                idle = 0;
+                continue;
+            }
+            if (header) {
+                char *nl = (char *)find_record_end(b->buf, b->buf + b->len);
+                if (!nl) {
+                    b->len = 0;
+                    if (eof) break;
+                    continue;
+                }
+                size_t skip = nl - b->buf + 1;
+                memmove(b->buf, nl + 1, b->len - skip);
+                b->len -= skip;
+                header = 0;
+                continue;
+            }
+            if (eof) break;
+            char *last = last_record_end(b->buf, b->len);
+            if (last) {
+                size_t tail = b->buf + b->len - (last + 1);
+                if (tail > r->carry_cap) {
+                    char *carry = realloc(r->carry, tail);
+                    if (!carry) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                    r->carry = carry;
+                    r->carry_cap = tail;
+                }
+                if (tail)
+                    memcpy(r->carry, last + 1, tail);
+                r->carry_len = tail;
+                b->len -= tail;
+                break;
+            }
+            /* linia dłuższa niż blok - jedyny przypadek przekroczenia budżetu */
+            char *grown = realloc(b->buf, b->cap * 2);
+            if (!grown) {
+                perror("realloc");
+                exit(1);
+            }
+            b->buf = grown;
+            b->cap *= 2;
+        }
+
+        pthread_mutex_lock(&r->mutex);
+        if (b->len > 0) {
+            b->state = BLOCK_FILLED;
+            r->filled++;
+        }
+        r->eof = eof;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+    }
+    return NULL;
+}
+
+// Wątek walidujący - bierze kolejne wypełnione bloki i szuka w nich błędnego rekordu
+void *stream_worker(void *arg) {
+    ring_t *r = arg;
+
+    pthread_mutex_lock(&r->mutex);
+    while (1) {
+        while (!r->stop && !r->eof && r->claimed == r->filled)
+            pthread_cond_wait(&r->cond, &r->mutex);
+        if (r->stop || r->claimed == r->filled)
+            break;
+        block_t *b = &r->blocks[r->claimed++ % r->count];
+        b->state = BLOCK_BUSY;
+        pthread_mutex_unlock(&r->mutex);
+
+        b->bad = validate_block(b->buf, b->buf + b->len);
+
+        pthread_mutex_lock(&r->mutex);
+        b->state = BLOCK_DONE;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return NULL;
+}
+
+// Uruchamia potok czytelnik -> n walidatorów -> emiter na deskryptorze fd.
+// Poprawne bloki są wypisywane zanim reszta wejścia zostanie przeczytana,
+// więc przy błędzie wyjście zawiera już wszystkie wcześniejsze rekordy.
+// watch >= 0 (deskryptor inotify) włącza śledzenie dopisywania (tryb -f).
+int run_stream(int fd, int watch, int n, int blocks, size_t block_size) {
+    ring_t r;
+    memset(&r, 0, sizeof(r));
+    r.fd = fd;
+    r.inotify = watch;
+    r.count = blocks;
+    r.blocks = calloc(blocks, sizeof(block_t));
+    for (int i = 0; i < blocks; i++) {
+        r.blocks[i].cap = block_size;
+        r.blocks[i].buf = malloc(block_size);
+    }
+    pthread_mutex_init(&r.mutex, NULL);
+    pthread_cond_init(&r.cond, NULL);
+
+    pthread_t reader, threads[n];
+    pthread_create(&reader, NULL, stream_reader, &r);
+    for (int i = 0; i < n; i++)
+        pthread_create(&threads[i], NULL, stream_worker, &r);
+
+    long line_no = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&r.mutex);
+    while (1) {
+        block_t *b = &r.blocks[r.emitted % r.count];
+        while (!(r.emitted < r.filled && b->state == BLOCK_DONE) && !(r.eof && r.emitted == r.filled))
+            pthread_cond_wait(&r.cond, &r.mutex);
+        if (r.emitted == r.filled)
+            break;
+        pthread_mutex_unlock(&r.mutex);
+
+        const char *good_end = b->bad ? b->bad : b->buf + b->len;
+        fwrite(b->buf, 1, good_end - b->buf, stdout);
+        if (watch >= 0)
+            fflush(stdout);
+        line_no += count_lines(b->buf, good_end);
+
+        pthread_mutex_lock(&r.mutex);
+        if (b->bad) {
+            fflush(stdout);
+            fprintf(stderr, "CSV error at line %ld\n", line_no + 1);
+            r.stop = 1;
+            ret = 1;
+            pthread_cond_broadcast(&r.cond);
+            break;
+        }
+        b->state = BLOCK_FREE;
+        r.emitted++;
+        pthread_cond_broadcast(&r.cond);
+    }
+    pthread_mutex_unlock(&r.mutex);
+    fflush(stdout);
+
+    if (ret)
+        pthread_cancel(reader);
+    pthread_join(reader, NULL);
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < blocks; i++)
+        free(r.blocks[i].buf);
+    free(r.blocks);
+    free(r.carry);
+    pthread_mutex_destroy(&r.mutex);
+    pthread_cond_destroy(&r.cond);
+    return ret;
+}
+
+/* ===================== WEJŚCIA ===================== */
+
+// Pomija pliki ukryte i indeksy .idx leżące obok danych
+static int input_filter(const struct dirent *e) {
+    size_t len = strlen(e->d_name);
+    return e->d_name[0] != '.' && !(len > 4 && !strcmp(e->d_name + len - 4, ".idx"));
+}
+
+// Dopisuje ścieżkę do listy wejść
+void push_input(const char *path) {
+    input_t *grown = realloc(inputs, (input_count + 1) * sizeof(input_t));
+    if (!grown) {
+        perror("realloc");
+        exit(1);
+    }
+    inputs = grown;
+    input_t *in = &inputs[input_count++];
+    memset(in, 0, sizeof(input_t));
+    in->path = strdup(path);
+    in->out_fd = STDOUT_FILENO;
+    atomic_init(&in->error_frag, INT_MAX);
+}
+
+// Dodaje plik do wejść; katalog rozwija (bez rekursji) na jego zwykłe pliki
+// w kolejności nazw
+void add_input(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        push_input(path);
+        return;
+    }
+
+    struct dirent **names;
+    int k = scandir(path, &names, input_filter, alphasort);
+    if (k < 0) {
+        perror(path);
+        exit(1);
+    }
+    for (int i = 0; i < k; i++) {
+        char *full;
+        if (asprintf(&full, "%s/%s", path, names[i]->d_name) < 0) {
+            perror("asprintf");
+            exit(1);
+        }
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode))
+            push_input(full);
+        free(full);
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Otwiera i mapuje plik wejściowy w całości; pusty plik zostaje bez mapowania
+int map_input(input_t *in) {
+    int fd = open(in->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &in->st) < 0) {
+        perror(in->path);
+        return -1;
+    }
+    if (!S_ISREG(in->st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", in->path);
+        close(fd);
+        return -1;
+    }
+    in->len = in->st.st_size;
+    if (in->len) {
+        in->data = mmap(NULL, in->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in->data == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+        madvise((void *)in->data, in->len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        madvise((void *)in->data, in->len, MADV_HUGEPAGE);
+#endif
+    }
+    close(fd);
+    return 0;
+}
+
+// Otwiera plik wyniku dir/<nazwa pliku wejściowego> dla trybu -o
+int open_output(input_t *in, const char *dir) {
+    const char *base = strrchr(in->path, '/');
+    char out_path[PATH_MAX];
+    snprintf(out_path, sizeof(out_path), "%s/%s", dir, base ? base + 1 : in->path);
+    in->out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in->out_fd < 0) {
+        perror(out_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* ===================== STROJENIE ===================== */
+
+// Tryb auto (n albo m podane jako "auto"): wątków tyle, ile procesorów, a
+// fragmenty na tyle drobne, żeby było ich kilkanaście na wątek, ale nie mniejsze
+// niż kilka tysięcy rekordów. Resztę dopasowuje worker, pobierając więcej
+// fragmentów naraz, gdy idą szybko (next_claim).
+
+#define AUTO_SAMPLES 16
+#define AUTO_SAMPLE_SIZE 4096
+#define AUTO_FRAGS_PER_THREAD 16
+#define AUTO_FRAG_RECORDS 4096
+#define AUTO_FRAG_MIN (64 << 10)
+#define AUTO_FRAG_MAX (16 << 20)
+
+// Szacuje średnią długość rekordu z kilku próbek rozłożonych równo po pliku
+double sample_line_length(const char *p, size_t len) {
+    size_t lines = 0, bytes = 0;
+    for (int i = 0; i < AUTO_SAMPLES; i++) {
+        size_t off = len / AUTO_SAMPLES * i;
+        const char *q = p + off;
+        const char *e = q + (len - off < AUTO_SAMPLE_SIZE ? len - off : AUTO_SAMPLE_SIZE);
+        bytes += e - q;
+        while ((q = memchr(q, '\n', e - q))) {
+            lines++;
+            q++;
+        }
+    }
+    return lines ? (double)bytes / lines : (double)len;
+}
+
+// Wyznacza n i m (te podane jako 0) z liczby procesorów, rozmiaru wejścia
+// i próbkowanej długości rekordu; decyzje wypisuje przy -v
+void auto_tune(int *n, int *m, off_t total, int stats) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const input_t *largest = NULL;
+    for (int f = 0; f < input_count; f++)
+        if (!largest || inputs[f].len > largest->len)
+            largest = &inputs[f];
+    double line = largest && largest->len ? sample_line_length(largest->data, largest->len) : 1;
+
+    int threads = *n ? *n : (cpus > 0 ? cpus : 1);
+    off_t frag = total / ((off_t)threads * AUTO_FRAGS_PER_THREAD);
+    if (frag < (off_t)(line * AUTO_FRAG_RECORDS))
+        frag = line * AUTO_FRAG_RECORDS;
+    if (frag < AUTO_FRAG_MIN)
+        frag = AUTO_FRAG_MIN;
+    if (frag > AUTO_FRAG_MAX)
+        frag = AUTO_FRAG_MAX;
+
+    if (!*m) {
+        off_t k = total / frag;
+        *m = k < 1 ? 1 : (k > INT_MAX / 2 ? INT_MAX / 2 : k);
+        adaptive = 1;
+    }
+    /* więcej wątków niż fragmentów tylko by czekało */
+    if (!*n)
+        *n = threads < *m ? threads : *m;
+    if (stats)
+        fprintf(stderr, "auto: cpus=%ld avg_record=%.1f B fragment=%lld KB n=%d m=%d adaptive=%d\n",
+                cpus, line, (long long)(total / *m) >> 10, *n, *m, adaptive);
+}
+
+/* ===================== MAIN ===================== */
+
+// Wypisuje składnię wywołania i kończy program
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-v] [-s] [-f] [-b blocks] [-B block_kb] [-a column] [-g column]\n"
+                    "       [-w column<op>value]... [-c col1,col2,...] [-i] [-r from-to] [-q] [-o dir]\n"
+                    "       [-S column] [-u column]\n"
+                    "       n|auto m|auto path|dir|-...\n", name);
+    fprintf(stderr, "  -v  print allocation and memory stats to stderr and check that the fragments\n"
+                    "      cover the data exactly, each starting at a record boundary\n");
+    fprintf(stderr, "  -s  stream the input through a ring of blocks (default for pipes and stdin)\n");
+    fprintf(stderr, "  -f  follow a growing file: after its end wait for appended records and emit\n"
+                    "      each complete batch as it arrives (until the file is removed or renamed)\n");
+    fprintf(stderr, "  -b  number of blocks in the ring (default 2n+2)\n");
+    fprintf(stderr, "  -B  block size in KiB (default 1024)\n");
+    fprintf(stderr, "  -a  print count/sum/min/max/avg of an integer column instead of the records\n");
+    fprintf(stderr, "  -g  group the aggregate (or a plain count) by a column\n");
+    fprintf(stderr, "  -w  keep only records where the column compares to value (< <= > >= = != ;\n"
+                    "      numeric when value is an integer); repeat for AND\n");
+    fprintf(stderr, "  -c  print only the listed columns, in that order\n");
+    fprintf(stderr, "  -i  use (and maintain) the record offset index path.idx\n");
+    fprintf(stderr, "  -r  process only data rows from..to (1-based, inclusive; implies -i)\n");
+    fprintf(stderr, "  -q  RFC 4180 quoting: commas and newlines inside \"...\" belong to the field\n");
+    fprintf(stderr, "  -S  sort the records by a column (numerically for an integer column; stable)\n");
+    fprintf(stderr, "  -u  keep only the first record (in input order) for each value of a column\n");
+    fprintf(stderr, "  -o  write each input's records to dir/<file name> instead of stdout\n");
+    fprintf(stderr, "n or m given as \"auto\" is sized from the CPU count, input size and sampled\n"
+                    "record length; with auto m each thread claims more fragments at a time while\n"
+                    "they finish quickly. -v prints the chosen values.\n");
+    fprintf(stderr, "Several files (or a directory of files) share one pool of n threads; m fragments\n"
+                    "are divided between them by size and the output keeps the argument order.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt, stats = 0, streaming = 0, follow = 0, blocks = 0;
+    size_t block_kb = 1024;
+    const char *agg_name = NULL, *group_name = NULL, *proj_spec = NULL;
+    const char *pred_specs[MAX_PREDS];
+    int use_index = 0;
+    unsigned long long row_from = 0, row_to = 0;
+    int rfc4180 = 0;
+    const char *out_dir = NULL;
+    const char *sort_name = NULL, *uniq_name = NULL;
+    while ((opt = getopt(argc, argv, "vsfb:B:a:g:w:c:ir:qo:S:u:")) != -1) {
+        switch (opt) {
+        case 'v':
+            stats = 1;
+            break;
+        case 's':
+            streaming = 1;
+            break;
+        case 'f':
+            follow = 1;
+            break;
+        case 'b':
+            blocks = atoi(optarg);
+            break;
+        case 'B':
+            block_kb = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            agg_name = optarg;
+            break;
+        case 'g':
+            group_name = optarg;
+            break;
+        case 'w':
+            if (npreds == MAX_PREDS)
+                usage(argv[0]);
+            pred_specs[npreds++] = optarg;
+            break;
+        case 'c':
+            proj_spec = optarg;
+            break;
+        case 'i':
+            use_index = 1;
+            break;
+        case 'q':
+            rfc4180 = 1;
+            break;
+        case 'o':
+            out_dir = optarg;
+            break;
+        case 'S':
+            sort_name = optarg;
+            break;
+        case 'u':
+            uniq_name = optarg;
+            break;
+        case 'r':
+            if (sscanf(optarg, "%llu-%llu", &row_from, &row_to) != 2 || row_from < 1 || row_to < row_from)
+                usage(argv[0]);
+            use_index = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 3)
+        usage(argv[0]);
+
+    /* "auto" zostaje jako 0 do auto_tune(), gdy rozmiar wejścia jest znany */
+    int n = strcmp(argv[optind], "auto") ? atoi(argv[optind]) : 0;
+    int m = strcmp(argv[optind + 1], "auto") ? atoi(argv[optind + 1]) : 0;
+    const char *path = argv[optind + 2];
+    int npaths = argc - optind - 2;
+    if ((n < 1 && strcmp(argv[optind], "auto")) || (m < 1 && strcmp(argv[optind + 1], "auto")) || block_kb < 1)
+        usage(argv[0]);
+
+    int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        return 1;
+    }
+
+    /* potoki, stdin (także przekierowany zwykły plik - nie ma ścieżki do
+       ponownego otwarcia) i jawne -s idą przez pierścień bloków o ograniczonej pamięci */
+    simd_init();
+    if (rfc4180)
+        quoted_init();
+    columnar = agg_name || group_name;
+    filtering = npreds > 0 || proj_spec;
+    int keyed = sort_name || uniq_name;
+    if (npaths == 1 && !S_ISDIR(st.st_mode) && (streaming || follow || fd == STDIN_FILENO || !S_ISREG(st.st_mode))) {
+        if (columnar || filtering || keyed || use_index || out_dir) {
+            fprintf(stderr, "-a/-g/-w/-c/-S/-u/-i/-r/-o need a regular file\n");
+            return 1;
+        }
+        /* -f: obserwacja założona przed pierwszym odczytem, więc żadne dopisanie nie ginie */
+        int watch = -1;
+        if (follow) {
+            if (!S_ISREG(st.st_mode)) {
+                fprintf(stderr, "-f needs a regular file\n");
+                return 1;
+            }
+            watch = inotify_init1(IN_CLOEXEC);
+            if (watch < 0 || inotify_add_watch(watch, path, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+                perror("inotify");
+                return 1;
+            }
+        }
+        if (!n) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            n = cpus > 0 ? cpus : 1;
+        }
+        if (blocks < 1)
+            blocks = 2 * n + 2;
+        int ret = run_stream(fd, watch, n, blocks, block_kb * 1024);
+        if (watch >= 0)
+            close(watch);
+        if (stats) {
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+            fprintf(stderr, "stats: blocks=%d block_size=%zu KB peak_rss=%ld KB\n",
+                    blocks, block_kb, ru.ru_maxrss);
+        }
+        return ret;
+    }
+    close(fd);
+
+    for (int i = optind + 2; i < argc; i++)
+        add_input(argv[i]);
+    if (streaming || follow || (row_from && input_count > 1) || (out_dir && (columnar || keyed))
+        || (columnar && keyed)) {
+        fprintf(stderr, "-s, -f and -r take a single file; -a/-g, -S/-u and -o exclude each other\n");
+        return 1;
+    }
+
+    /* mapowanie wszystkich plików - workerzy czytają fragmenty bez kopiowania */
+    off_t total = 0;
+    for (int f = 0; f < input_count; f++) {
+        if (map_input(&inputs[f]) < 0)
+            return 1;
+        total += inputs[f].len;
+    }
+    if (!n || !m)
+        auto_tune(&n, &m, total, stats);
+    worker_count = n;
+
+    /* m fragmentów rozdzielonych proporcjonalnie do rozmiaru, co najmniej jeden
+       na niepusty plik; wszystkie trafiają do jednej kolejki workerów */
+    for (int f = 0; f < input_count; f++) {
+        input_t *in = &inputs[f];
+        in->first_task = task_count;
+        in->ntasks = in->len ? (int)((double)m * in->len / total) : 0;
+        if (in->len && in->ntasks < 1)
+            in->ntasks = 1;
+        task_count += in->ntasks;
+    }
+    tasks = calloc(task_count ? task_count : 1, sizeof(fragment_t));
+    results = calloc(task_count ? task_count : 1, sizeof(list_t));
+    col_results = calloc(task_count ? task_count : 1, sizeof(collist_t));
+
+    const input_t *schema = NULL;   // plik, z którego nagłówka wzięto kolumny
+    off_t schema_len = 0;
+    for (int f = 0; f < input_count; f++) {
+        input_t *in = &inputs[f];
+        if (!in->len)
+            continue;
+        data = in->data;
+        data_len = in->len;
+
+        /* nagłówek */
+        const char *hdr_end = find_record_end(data, data + data_len);
+        off_t data_start = hdr_end ? hdr_end - data + 1 : (off_t)data_len;
+
+        if ((columnar || filtering || keyed) && schema) {
+            /* kolumny są wybierane po numerze, więc wszystkie pliki muszą je mieć te same */
+            if (data_start != schema_len || memcmp(data, schema->data, data_start)) {
+                fprintf(stderr, "%s: header differs from %s\n", in->path, schema->path);
+                return 1;
+            }
+        } else if (columnar || filtering || keyed) {
+            schema = in;
+            schema_len = data_start;
+            const char *first = data_start < (off_t)data_len ? data + data_start : NULL;
+            const char *first_end = first ? find_record_end(first, data + data_len) : NULL;
+            parse_header(data, data_start, first, first ? (first_end ? first_end : data + data_len) - first : 0);
+            if (agg_name && ((agg_col = find_column(agg_name)) < 0 || columns[agg_col].type != COL_INT)) {
+                fprintf(stderr, "-a: no integer column '%s'\n", agg_name);
+                return 1;
+            }
+            if (group_name && (group_col = find_column(group_name)) < 0) {
+                fprintf(stderr, "-g: no column '%s'\n", group_name);
+                return 1;
+            }
+            if (group_col >= 0 && group_col == agg_col) {
+                /* kolumna grupowania jest przechowywana jako tekst, więc nie może być sumowana */
+                fprintf(stderr, "-a and -g must name different columns\n");
+                return 1;
+            }
+            if (group_col >= 0)
+                columns[group_col].type = COL_STR;
+            for (int i = 0; i < npreds; i++)
+                if (parse_predicate(pred_specs[i], &preds[i]) < 0) {
+                    fprintf(stderr, "-w: bad predicate '%s'\n", pred_specs[i]);
+                    return 1;
+                }
+            if (proj_spec) {
+                char *spec = strdup(proj_spec), *save = NULL;
+                for (char *tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                    if (nproj == MAX_COLS || (proj[nproj++] = find_column(tok)) < 0) {
+                        fprintf(stderr, "-c: no column '%s'\n", tok);
+                        free(spec);
+                        return 1;
+                    }
+                }
+                free(spec);
+            }
+            if (sort_name && (sort_col = output_column(sort_name)) < 0) {
+                fprintf(stderr, "-S: no column '%s' in the output\n", sort_name);
+                return 1;
+            }
+            if (uniq_name && (uniq_col = output_column(uniq_name)) < 0) {
+                fprintf(stderr, "-u: no column '%s' in the output\n", uniq_name);
+                return 1;
+            }
+            sort_numeric = sort_col >= 0 && columns[nproj ? proj[sort_col] : sort_col].type == COL_INT;
+        }
+
+        /* fragmenty; z indeksem ich granice wynikają z liczby rekordów, bez szukania '\n' */
+        fragment_t *frags = tasks + in->first_task;
+        if (use_index) {
+            line_index_t index;
+            idx_open(&index, in->path, &in->st, data_start, stats);
+            uint64_t last_row = index.hdr.records;
+            if (row_from) {
+                in->first_row = row_from - 1 < last_row ? row_from - 1 : last_row;
+                last_row = row_to < last_row ? row_to : last_row;
+            }
+            split_fragments_by_records(&index, frags, in->ntasks, in->first_row, last_row);
+            idx_close(&index);
+        } else {
+            split_fragments(frags, in->ntasks, data_start, n);
+        }
+        if (stats && in->ntasks && check_fragments(in->path, frags, in->ntasks, data_start, !row_from) < 0)
+            return 1;
+        for (int i = 0; i < in->ntasks; i++)
+            frags[i].file = f;
+    }
+
+    pthread_t threads[n];
+    arena_t arenas[n];
+
+    for (int i = 0; i < n; i++) {
+        arena_init(&arenas[i]);
+        pthread_create(&threads[i], NULL, worker, &arenas[i]);
+    }
+
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    int failed = 0;
+    for (int f = 0; f < input_count; f++) {
+        input_t *in = &inputs[f];
+        if (in->error_frag == INT_MAX)
+            continue;
+        /* numer linii w pliku: suma prefiksowa linii z jego fragmentów przed błędnym
+           (każdy z nich został w całości przetworzony) plus pozycja w błędnym */
+        long line = 1 + in->first_row;
+        for (int i = in->first_task; i <= in->error_frag; i++)
+            line += tasks[i].lines;
+        if (input_count == 1)
+            fprintf(stderr, "CSV error at line %ld\n", line);
+        else
+            fprintf(stderr, "CSV error in %s at line %ld\n", in->path, line);
+        failed = 1;
+    }
+    /* jeden plik: błąd przerywa wszystko; przy wielu pozostałe pliki są wypisywane */
+    if (failed && input_count == 1)
+        return 1;
+
+    for (int f = 0; out_dir && f < input_count; f++)
+        if (inputs[f].error_frag == INT_MAX && open_output(&inputs[f], out_dir) < 0)
+            return 1;
+
+    if (columnar)
+        run_aggregate(n);
+    else if (keyed ? run_sort(n) < 0 : write_output(n) < 0)
+        return 1;
+
+    if (stats) {
+        long regions = 0, chunks = 0;
+        struct rusage ru;
+        for (int i = 0; i < n; i++) {
+            regions += arenas[i].region_count;
+            chunks += arenas[i].chunk_count;
+        }
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(stderr, "stats: files=%d fragments=%d claims=%d arena_regions=%ld chunks=%ld peak_rss=%ld KB\n",
+                input_count, task_count, (int)claims, regions, chunks, ru.ru_maxrss);
+    }
+
+    for (int i = 0; i < n; i++)
+        arena_free(&arenas[i]);
+    for (int f = 0; f < input_count; f++) {
+        if (inputs[f].len)
+            munmap((void *)inputs[f].data, inputs[f].len);
+        if (inputs[f].out_fd != STDOUT_FILENO)
+            close(inputs[f].out_fd);
+        free(inputs[f].path);
+    }
+    free(inputs);
+    free(col_results);
+    free(results);
+    free(tasks);
+    return failed;
+}
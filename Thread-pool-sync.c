@@ -1,12 +1,21 @@
 #define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
@@ -14,19 +23,225 @@
 #define BUFFERSIZE 256
 #define READCHUNKS 4
 #define THREAD_NUM 3
+#define QUEUE_SIZE 16
+#define QUEUE_RESERVE 4         // miejsca w kolejce dostępne tylko dla PRIO_HIGH
+#define PUSH_TIMEOUT_MS 1000
+#define SPAWN_WAIT_MS 200
+#define IDLE_TIMEOUT_MS 5000
+#define DEQUE_SIZE 256          // pojemność deque wątku (potęga dwójki)
+#define GRAB_BATCH 32           // ile zadań wątek przenosi naraz z kolejki do swojej deque
+#define GEN_BUFFER (1 << 20)    // bufor generatora - jeden pwrite na tyle bajtów
+#define GEN_ALIGN 4096          // wyrównanie bufora i zapisów (wymóg O_DIRECT)
+#define HIST_SUB_BITS 6         // histogram: 2^(HIST_SUB_BITS-1) przedziałów na potęgę dwójki (błąd ~3%)
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((1 << HIST_SUB_BITS) + (64 - HIST_SUB_BITS) * HIST_HALF)
+#define MIX_BULK_US 2000        // -x: czas pracy zadania bulk
+#define MIX_NORMAL_US 200       // -x: czas pracy zadania normal
+#define MIX_HIGH_US 50          // -x: czas pracy zadania high
+#define MIX_HIGH_DEADLINE_MS 20 // -x: termin zadań high
+#define MIX_PERIOD_US 1000      // -x: odstęp między zadaniami interaktywnymi
+#define STRESS_PRODUCERS 4      // -t: wątki zgłaszające zadania
+#define STRESS_BURST 1000       // -t: zadań w serii, po której producent robi przerwę
+#define BATCH_MAX (1 << 20)     // najwięcej zadań w jednej linii "batch"
+#define BATCH_CHAIN 256         // najwięcej zadań paczki w jednym miejscu kolejki
+#define RECORD_MAX 128          // najdłuższy rekord zakończenia w strumieniu wyników
+#define LABEL_SIZE 48           // numer zadania "B.N" w komunikatach
 volatile sig_atomic_t work = 1;
+atomic_int *stress_runs;        // -t: ile razy wykonano zadanie o danym numerze
 
+typedef enum
+{
+    JOB_RANDOM,     // read_random - plik z losowymi danymi
+    JOB_GENERATE,   // generate_files - szybki generator plików (-s)
+    JOB_SPIN,       // aktywne czekanie przez size mikrosekund (tryb -x)
+    JOB_CHECKSUM,   // suma kontrolna plików zadań JOB_GENERATE, od których zależy
+    JOB_MERGE,      // łączy sumy kontrolne zadań, od których zależy
+    JOB_STRESS,     // liczy swoje wykonania w stress_runs[id - 1] (tryb -t)
+    JOB_NOOP        // puste zadanie (tryb -b)
+} job_type_t;
+
+// Klasy priorytetu. Zadanie dostaje wirtualny termin: chwila zgłoszenia plus
+// prio_aging_ms klasy albo jego własny termin, jeśli jest wcześniejszy. Pula
+// wykonuje zadania w kolejności tych terminów, więc zadanie bulk czekające
+// dłużej niż prio_aging_ms[PRIO_BULK] wyprzedza świeże zadania high
+typedef enum
+{
+    PRIO_HIGH,
+    PRIO_NORMAL,
+    PRIO_BULK,
+    PRIO_CLASSES
+} prio_t;
+
+const long prio_aging_ms[PRIO_CLASSES] = {0, 100, 1000};
+const char *prio_names[PRIO_CLASSES] = {"high", "normal", "bulk"};
+
+// Stan zadania; stany od JOB_DONE w górę są końcowe
+typedef enum
+{
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,     // error zawiera kod errno
+    JOB_CANCELLED,  // anulowane przed startem albo porzucone przy zamykaniu puli
+    JOB_EXPIRED     // termin minął przed startem - odrzucone zamiast wykonane z opóźnieniem
+} job_status_t;
+
+enum
+{
+    GEN_DIRECT = 1,     // fallocate + O_DIRECT
+    GEN_KERNEL = 2      // getrandom() zamiast xoshiro256**
+};
+
+typedef struct edge edge_t;
+typedef struct job job_t;
+typedef struct batch batch_t;
+
+// Paczka zadań zgłoszona jedną linią "batch" - zadania mają w niej numery
+// 1..count i wspólny wzorzec nazw plików. Referencję trzyma każde zadanie
+// paczki; remaining odlicza zadania do rekordu końca paczki
+struct batch
+{
+    long id, count;
+    char path[BUFFERSIZE];      // wzorzec nazwy pliku, '#' zastępuje "numer-plik"
+    atomic_long remaining, done;
+    atomic_int refs;
+    struct timespec submitted;
+};
+
+// Zadanie, a zarazem uchwyt zwracany przez pool_submit. Żyje, dopóki
+// referencję trzyma pula, zgłaszający (job_release zwalnia swoją) albo
+// zadanie, które od niego zależy
+// Zależności: pending to liczba niezakończonych poprzedników plus jeden,
+// zdejmowany przez pool_submit - kto sprowadzi go do zera, ten wstawia zadanie
+// do kolejki. successors to lista następników dokładana przez CAS; kończące
+// się zadanie zamyka ją (edges_closed) i zmniejsza pending każdego następnika
+struct job
+{
+    long id;
+    job_type_t type;
+    size_t size;                // JOB_GENERATE: rozmiar pliku w bajtach
+    int files, flags;           // JOB_GENERATE: liczba plików i GEN_*
+    prio_t prio;
+    long deadline_ms;           // termin względem zgłoszenia; 0 - bez terminu
+    long deadline, rank;        // ns CLOCK_MONOTONIC: termin bezwzględny (0 - brak) i klucz kolejności
+    atomic_int status;          // job_status_t, zarazem słowo futeksa dla job_wait
+    int error;                  // errno przy JOB_FAILED
+    atomic_int waiters;         // ilu wątków czeka w job_wait - bez nich job_finish nie woła futeksa
+    atomic_int refs;
+    struct timespec submitted;  // CLOCK_MONOTONIC - do mierzenia czasu czekania (od chwili gotowości)
+    atomic_int pending;
+    atomic_int dep_failed;      // któryś poprzednik nie skończył się JOB_DONE - zadanie zostanie anulowane
+    _Atomic(edge_t *) successors;
+    job_t **inputs;             // poprzednicy (z referencją) - JOB_CHECKSUM i JOB_MERGE czytają ich wyniki
+    int ninputs;
+    uint64_t result;            // JOB_CHECKSUM, JOB_MERGE: suma kontrolna
+    job_t *next;                // lista nadmiarowa wątku albo reszta paczki w kolejce
+    batch_t *batch;             // paczka zadania (id to wtedy numer w paczce); NULL - zadanie pojedyncze
+};
+
+// Krawędź grafu zależności: element listy następników poprzednika
+struct edge
+{
+    job_t *job;
+    edge_t *next;
+};
+
+edge_t edges_closed;    // znacznik zamkniętej listy następników (poprzednik się zakończył)
+
+// Histogram w stylu HDR: przedziały liniowe wewnątrz każdej potęgi dwójki,
+// więc względny błąd jest stały od nanosekund do godzin. Liczniki atomowe -
+// zapis z wielu wątków bez blokady
+typedef struct
+{
+    atomic_long counts[HIST_BUCKETS];
+    atomic_long total, max;
+} histogram_t;
+
+// Ograniczona kolejka wejściowa zadań dla wielu producentów - kopiec
+// uporządkowany po rank, więc z czoła schodzi zadanie o najwcześniejszym terminie
+// Pełna kolejka blokuje producenta zamiast gubić zadania (PRIO_HIGH ma
+// QUEUE_RESERVE miejsc ponad limit); wątki puli zabierają z niej zadania
+// paczkami do swoich deque. Element kolejki może być łańcuchem zadań (next)
+// o wspólnym rank - paczka z linii "batch" zajmuje jedno miejsce
+typedef struct
+{
+    job_t *jobs[QUEUE_SIZE + QUEUE_RESERVE];
+    int count;
+    int closed;     // koniec wejścia - po opróżnieniu kolejki wątki kończą pracę
+    atomic_long top_rank;       // rank zadania na czole (LONG_MAX gdy pusta) - do odczytu bez blokady
+    pthread_mutex_t mutex;
+    pthread_cond_t not_full;
+} queue_t;
+
+// Deque Chase-Lev: właściciel dokłada i zdejmuje zadania z dołu (bottom) bez
+// blokady, pozostałe wątki kradną z góry (top) przez CAS
+// rank[] czyta i pisze tylko właściciel - żeby porównać swoje zadanie z czołem kolejki
+typedef struct
+{
+    atomic_long top, bottom;
+    _Atomic(job_t *) buf[DEQUE_SIZE];
+    long rank[DEQUE_SIZE];
+} deque_t;
+
+enum
+{
+    WORKER_RUNNING,
+    WORKER_PARKED       // śpi na futeksie state, budzi go pool_wake_one
+};
+
+typedef struct pool pool_t;
+
+// Wątek puli - własna deque, słowo futeksa do usypiania i generator do wyboru ofiary
+// Bufor generatora należy do slotu i przeżywa kolejne wątki w nim uruchomione
 typedef struct
 {
     int id;
-    int *idlethreads;
-    int *condition;
-    pthread_cond_t *cond;
-    pthread_mutex_t *mutex;
-} thread_arg;
+    int active;                 // slot zajęty przez działający wątek
+    int cpu;                    // procesor, do którego przypięty jest wątek slotu; -1 - bez przypięcia
+    atomic_int state;
+    unsigned rng;
+    deque_t deque;
+    job_t *overflow;            // gotowi następnicy, którzy nie zmieścili się w deque (tylko właściciel)
+    pool_t *pool;
+    char *gen_buf;              // GEN_BUFFER bajtów wyrównanych do GEN_ALIGN, alokowany przy pierwszym użyciu
+    uint64_t xoshiro[4];        // stan xoshiro256**, ziarno z getrandom() przy starcie wątku
+    atomic_long gen_bytes, gen_ns;  // suma zapisanych bajtów i czasu - do GB/s w "stats"
+    char records[PIPE_BUF];     // niezapisane rekordy zakończenia zadań z paczek
+    size_t records_len;
+} worker_t;
+
+// Pula o zmiennej liczbie wątków: od min do max. Nowy wątek powstaje, gdy
+// najstarsze zadanie czeka w kolejce dłużej niż spawn_wait_ms, a wątek bez
+// pracy przez idle_timeout_ms kończy się, o ile pula ma więcej niż min wątków.
+// Sloty workers[] (max sztuk) żyją przez cały czas pracy puli, więc złodziej
+// może zajrzeć do deque wątku, który właśnie się zakończył (jest pusta).
+struct pool
+{
+    queue_t queue;
+    worker_t *workers;
+    int min, max;
+    int spawn_wait_ms, idle_timeout_ms;
+    int size, next_id;
+    int closing;
+    atomic_int parked;          // ile wątków śpi - producent budzi tylko, gdy > 0
+    atomic_long steals, parks;
+    atomic_long blocked;        // zgłoszone zadania czekające na poprzedników
+    long spawned, retired;
+    histogram_t wait_hist[PRIO_CLASSES], run_hist[PRIO_CLASSES];   // czas w kolejce i wykonania (ns)
+    atomic_long dropped[PRIO_CLASSES];  // zadania odrzucone po terminie
+    int results_fd;             // strumień rekordów zakończenia zadań z paczek (-r, domyślnie stdout)
+    atomic_long batch_status[JOB_EXPIRED + 1];  // zakończone zadania z paczek według stanu - do "jobs:"
+    pthread_t manager;          // co spawn_wait_ms/2 sprawdza, czy kolejka nie czeka za długo
+    pthread_mutex_t mutex;
+    pthread_cond_t exited;      // sygnalizowane, gdy pula zmniejsza się przy zamykaniu
+};
 
 // Handler sygnału SIGINT - ustawia flagę work na 0 aby zakończyć program
-void sigint_handler(int sig) { work = 0; }
+void sigint_handler(int sig)
+{
+    (void)sig;
+    work = 0;
+}
 
 // Ustawia obsługę sygnału używając sigaction
 void set_handler(void (*f)(int), int sigNo)
@@ -78,126 +293,2273 @@ ssize_t bulk_write(int fd, char *buf, size_t count)
 // Funkcja cleanup wywoływana przy anulowaniu wątku - odblokowuje mutex
 void cleanup(void *arg) { pthread_mutex_unlock((pthread_mutex_t *)arg); }
 
+// Inicjalizuje pustą kolejkę zadań
+void queue_init(queue_t *q)
+{
+    memset(q, 0, sizeof(queue_t));
+    atomic_store(&q->top_rank, LONG_MAX);
+    if (pthread_mutex_init(&q->mutex, NULL) != 0)
+        ERR("pthread_mutex_init");
+    if (pthread_cond_init(&q->not_full, NULL) != 0)
+        ERR("pthread_cond_init");
+}
+
+// Zwalnia zasoby kolejki
+void queue_destroy(queue_t *q)
+{
+    pthread_cond_destroy(&q->not_full);
+    pthread_mutex_destroy(&q->mutex);
+}
+
+// Wylicza chwilę (CLOCK_REALTIME) oddaloną o ms milisekund - dla pthread_cond_timedwait
+void deadline_after(struct timespec *deadline, int ms)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// Zwraca liczbę milisekund, które upłynęły od chwili t (CLOCK_MONOTONIC)
+long elapsed_ms(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+// Przywraca porządek kopca od pozycji i w górę (po dodaniu na koniec)
+void heap_up(job_t **heap, int i)
+{
+    job_t *job = heap[i];
+    while (i > 0 && heap[(i - 1) / 2]->rank > job->rank)
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = job;
+}
+
+// Przywraca porządek kopca od pozycji i w dół (po zdjęciu czoła)
+void heap_down(job_t **heap, int count, int i)
+{
+    job_t *job = heap[i];
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && heap[child + 1]->rank < heap[child]->rank)
+            child++;
+        if (heap[child]->rank >= job->rank)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = job;
+}
+
+// Dodaje zadanie do kolejki; przy pełnej kolejce czeka najwyżej timeout_ms
+// Zwraca 0 albo ETIMEDOUT (zadanie nie zostało dodane, można spróbować ponownie);
+// w *depth zapisuje liczbę zadań w kolejce po dodaniu
+int queue_push(queue_t *q, job_t *job, int timeout_ms, int *depth)
+{
+    struct timespec deadline;
+    int limit = job->prio == PRIO_HIGH ? QUEUE_SIZE + QUEUE_RESERVE : QUEUE_SIZE;
+    volatile int ret = 0;   // zmieniana między pthread_cleanup_push a pop (setjmp)
+    deadline_after(&deadline, timeout_ms);
+    pthread_cleanup_push(cleanup, (void *)&q->mutex);
+    if (pthread_mutex_lock(&q->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    while (q->count >= limit && ret == 0)
+    {
+        ret = pthread_cond_timedwait(&q->not_full, &q->mutex, &deadline);
+        if (ret != 0 && ret != ETIMEDOUT)
+            ERR("pthread_cond_timedwait");
+    }
+    if (q->count < limit)
+    {
+        q->jobs[q->count] = job;
+        heap_up(q->jobs, q->count++);
+        atomic_store_explicit(&q->top_rank, q->jobs[0]->rank, memory_order_relaxed);
+        *depth = q->count;
+        ret = 0;
+    }
+    pthread_cleanup_pop(1);
+    return ret;
+}
+
+// Zabiera z czoła kolejki do max zadań (w kolejności rank) o rank mniejszym
+// niż limit, bez czekania - z łańcucha paczki po kolei; zwraca ich liczbę
+int queue_take(queue_t *q, job_t **jobs, int max, long limit)
+{
+    int n = 0;
+    if (pthread_mutex_lock(&q->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    while (n < max && q->count > 0 && q->jobs[0]->rank < limit)
+    {
+        job_t *job = q->jobs[0];
+        jobs[n++] = job;
+        if (job->next != NULL)
+        {
+            /* reszta paczki zostaje w kolejce na miejscu zdjętego zadania */
+            q->jobs[0] = job->next;
+            job->next = NULL;
+        }
+        else
+            q->jobs[0] = q->jobs[--q->count];
+        heap_down(q->jobs, q->count, 0);
+    }
+    atomic_store_explicit(&q->top_rank, q->count ? q->jobs[0]->rank : LONG_MAX, memory_order_relaxed);
+    if (n > 0 && pthread_cond_broadcast(&q->not_full) != 0)
+        ERR("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&q->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    return n;
+}
+
+// Zwraca liczbę zadań w kolejce, a w *closed czy kolejka jest zamknięta
+int queue_pending(queue_t *q, int *closed)
+{
+    int n;
+    if (pthread_mutex_lock(&q->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    n = q->count;
+    if (closed)
+        *closed = q->closed;
+    if (pthread_mutex_unlock(&q->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    return n;
+}
+
+// Zwraca ile milisekund czeka zadanie z czoła kolejki (0 gdy kolejka jest pusta)
+long queue_oldest_wait(queue_t *q)
+{
+    long ms = 0;
+    if (pthread_mutex_lock(&q->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    if (q->count > 0)
+        ms = elapsed_ms(&q->jobs[0]->submitted);
+    if (pthread_mutex_unlock(&q->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    return ms;
+}
+
+// Zamyka kolejkę i budzi czekających producentów; zadania już w kolejce
+// zostaną wykonane, chyba że program kończy się po SIGINT
+void queue_close(queue_t *q)
+{
+    if (pthread_mutex_lock(&q->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    q->closed = 1;
+    if (pthread_cond_broadcast(&q->not_full) != 0)
+        ERR("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&q->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+}
+
+// Dokłada zadanie na dół deque (tylko właściciel); zwraca -1 gdy deque jest pełna
+int deque_push(deque_t *d, job_t *job)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= DEQUE_SIZE)
+        return -1;
+    d->rank[b & (DEQUE_SIZE - 1)] = job->rank;
+    atomic_store_explicit(&d->buf[b & (DEQUE_SIZE - 1)], job, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return 0;
+}
+
+// Zdejmuje zadanie z dołu deque (tylko właściciel); o ostatnie zadanie
+// rywalizuje ze złodziejami przez CAS na top
+job_t *deque_take(deque_t *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    job_t *job = NULL;
+    if (t <= b)
+    {
+        job = atomic_load_explicit(&d->buf[b & (DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (t == b)
+        {
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed))
+                job = NULL;
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    }
+    else
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return job;
+}
+
+// Kradnie zadanie z góry cudzej deque; NULL gdy jest pusta albo inny wątek był szybszy
+job_t *deque_steal(deque_t *d)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    job_t *job = atomic_load_explicit(&d->buf[t & (DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return job;
+}
+
+// Liczba zadań w deque (dokładna tylko dla właściciela, złodzieje mogą ją zmniejszać)
+long deque_count(deque_t *d)
+{
+    long n = atomic_load_explicit(&d->bottom, memory_order_relaxed) - atomic_load_explicit(&d->top, memory_order_acquire);
+    return n > 0 ? n : 0;
+}
+
+// Rank zadania, które właściciel zdejmie jako następne (LONG_MAX gdy deque jest
+// pusta); tylko właściciel. Jeśli złodziej właśnie je zabrał, wynik jest tylko wskazówką
+long deque_next_rank(deque_t *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    return b > t ? d->rank[(b - 1) & (DEQUE_SIZE - 1)] : LONG_MAX;
+}
+
+// Czy deque jest (prawie na pewno) pusta - do sprawdzenia przed uśpieniem
+int deque_empty(deque_t *d)
+{
+    return atomic_load(&d->bottom) <= atomic_load(&d->top);
+}
+
+// Usypia wątek na słowie futeksa, dopóki ma wartość val (najwyżej timeout_ms,
+// ujemny timeout - bez limitu). Zwraca ETIMEDOUT po upływie czasu, 0 po obudzeniu
+int futex_wait(atomic_int *addr, int val, int timeout_ms)
+{
+    struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    if (syscall(SYS_futex, (int *)addr, FUTEX_WAIT_PRIVATE, val, timeout_ms < 0 ? NULL : &ts, NULL, 0) < 0)
+    {
+        if (errno == ETIMEDOUT)
+            return ETIMEDOUT;
+        if (errno != EAGAIN && errno != EINTR)
+            ERR("futex");
+    }
+    return 0;
+}
+
+// Budzi do count wątków śpiących na słowie futeksa
+void futex_wake(atomic_int *addr, int count)
+{
+    if (syscall(SYS_futex, (int *)addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) < 0)
+        ERR("futex");
+}
+
+// Numer przedziału histogramu dla wartości v
+int hist_index(uint64_t v)
+{
+    if (v < (1 << HIST_SUB_BITS))
+        return v;
+    int shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+    return (1 << HIST_SUB_BITS) + (shift - 1) * HIST_HALF + (int)(v >> shift) - HIST_HALF;
+}
+
+// Największa wartość, która trafia do przedziału idx
+uint64_t hist_highest(int idx)
+{
+    if (idx < (1 << HIST_SUB_BITS))
+        return idx;
+    int k = idx - (1 << HIST_SUB_BITS), shift = k / HIST_HALF + 1;
+    return ((uint64_t)(HIST_HALF + k % HIST_HALF) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_record(histogram_t *h, uint64_t v)
+{
+    long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->counts[hist_index(v)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    while ((long)v > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, v, memory_order_relaxed,
+                                                                    memory_order_relaxed))
+        ;
+}
+
+// Wartość (górna granica przedziału, nie większa niż max), poniżej której
+// leży percentile procent próbek
+uint64_t hist_percentile(histogram_t *h, long total, double percentile)
+{
+    uint64_t max = atomic_load(&h->max);
+    long seen = 0, target = (long)(total * percentile / 100.0 + 0.5);
+    int i;
+    if (target < 1)
+        target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        if ((seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed)) >= target)
+            return hist_highest(i) < max ? hist_highest(i) : max;
+    return max;
+}
+
+// Wypisuje percentyle histogramu (w mikrosekundach); full dodaje rozkład -
+// niepuste przedziały z licznikiem i skumulowanym procentem
+void hist_dump(const char *name, histogram_t *h, int full)
+{
+    long total = atomic_load(&h->total), seen = 0;
+    int i;
+    if (total == 0)
+    {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    printf("%s: count=%ld p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n", name, total,
+           hist_percentile(h, total, 50) / 1e3, hist_percentile(h, total, 90) / 1e3,
+           hist_percentile(h, total, 99) / 1e3, hist_percentile(h, total, 99.9) / 1e3,
+           atomic_load(&h->max) / 1e3);
+    for (i = 0; full && i < HIST_BUCKETS; i++)
+    {
+        long count = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (count == 0)
+            continue;
+        seen += count;
+        printf("  <= %12.1fus %10ld %8.3f%%\n", hist_highest(i) / 1e3, count, 100.0 * seen / total);
+    }
+}
+
+long timespec_ns(const struct timespec *t) { return t->tv_sec * 1000000000L + t->tv_nsec; }
+
+// Nanosekundy od t do teraz (CLOCK_MONOTONIC)
+long elapsed_ns(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_ns(&now) - timespec_ns(t);
+}
+
+void batch_release(batch_t *batch)
+{
+    if (atomic_fetch_sub(&batch->refs, 1) == 1)
+        free(batch);
+}
+
+// Zwalnia referencję do zadania; ostatnia zwalnia pamięć i referencje do poprzedników i paczki
+void job_release(job_t *job)
+{
+    int i;
+    if (atomic_fetch_sub(&job->refs, 1) != 1)
+        return;
+    for (i = 0; i < job->ninputs; i++)
+        job_release(job->inputs[i]);
+    if (job->batch != NULL)
+        batch_release(job->batch);
+    free(job->inputs);
+    free(job);
+}
+
+// Tworzy kopię wzorcowego zadania z kolejnym numerem; referencję dostaje wywołujący
+job_t *job_new(const job_t *proto, long id)
+{
+    job_t *job = malloc(sizeof(job_t));
+    if (job == NULL)
+        ERR("malloc");
+    *job = *proto;
+    job->id = id;
+    job->error = 0;
+    job->inputs = NULL;
+    job->ninputs = 0;
+    job->result = 0;
+    job->next = NULL;
+    job->batch = NULL;
+    atomic_store(&job->status, JOB_QUEUED);
+    atomic_store(&job->waiters, 0);
+    atomic_store(&job->refs, 1);
+    atomic_store(&job->pending, 1);
+    atomic_store(&job->dep_failed, 0);
+    atomic_store(&job->successors, NULL);
+    return job;
+}
+
+// Dodaje zależność: job wystartuje dopiero po zakończeniu pred (a gdy pred
+// nie skończy się JOB_DONE, job zostanie anulowane). Wywoływać przed
+// pool_submit(job); pred może być już zgłoszone, a nawet zakończone
+void job_depend(job_t *job, job_t *pred)
+{
+    edge_t *edge = malloc(sizeof(edge_t));
+    job_t **grown = realloc(job->inputs, (job->ninputs + 1) * sizeof(job_t *));
+    if (edge == NULL || grown == NULL)
+        ERR("malloc");
+    job->inputs = grown;
+    job->inputs[job->ninputs++] = pred;
+    atomic_fetch_add(&pred->refs, 1);
+    edge->job = job;
+    atomic_fetch_add(&job->pending, 1);
+    edge_t *head = atomic_load(&pred->successors);
+    do
+    {
+        if (head == &edges_closed)
+        {
+            /* pred już się zakończył - jego stan jest ustalony przed zamknięciem listy */
+            free(edge);
+            if (atomic_load(&pred->status) != JOB_DONE)
+                atomic_store(&job->dep_failed, 1);
+            atomic_fetch_sub(&job->pending, 1);
+            return;
+        }
+        edge->next = head;
+    } while (!atomic_compare_exchange_weak(&pred->successors, &head, edge));
+}
+
+// Ustawia stan końcowy i budzi wszystkich czekających w job_wait
+void job_finish(job_t *job, job_status_t status, int error)
+{
+    job->error = error;
+    atomic_store(&job->status, status);
+    if (atomic_load(&job->waiters) > 0)
+        futex_wake(&job->status, INT_MAX);
+}
+
+// Stan zadania bez czekania
+job_status_t job_poll(job_t *job)
+{
+    return atomic_load(&job->status);
+}
+
+// Czeka na zakończenie zadania najwyżej timeout_ms (ujemny - bez limitu)
+// Zwraca stan końcowy albo -1 po upływie czasu lub przerwaniu sygnałem
+int job_wait(job_t *job, int timeout_ms)
+{
+    struct timespec start;
+    int status;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    atomic_fetch_add(&job->waiters, 1);
+    while ((status = atomic_load(&job->status)) < JOB_DONE)
+    {
+        int left = timeout_ms < 0 ? -1 : timeout_ms - (int)elapsed_ms(&start);
+        if ((timeout_ms >= 0 && left <= 0) || !work)
+        {
+            status = -1;
+            break;
+        }
+        futex_wait(&job->status, status, left);
+    }
+    atomic_fetch_sub(&job->waiters, 1);
+    return status;
+}
+
+// Anuluje zadanie, które jeszcze nie wystartowało; wątek, który je potem
+// zdejmie, tylko zwolni referencję. Zwraca 0 albo -1, gdy jest już za późno
+int job_cancel(job_t *job)
+{
+    int expected = JOB_QUEUED;
+    if (!atomic_compare_exchange_strong(&job->status, &expected, JOB_RUNNING))
+        return -1;
+    job_finish(job, JOB_CANCELLED, 0);
+    return 0;
+}
+
+const char *job_status_name(int status)
+{
+    static const char *names[] = {"queued", "running", "done", "failed", "cancelled", "expired"};
+    return status >= 0 && status <= JOB_EXPIRED ? names[status] : "unknown";
+}
+
 // Czyta losowe dane z /dev/urandom i zapisuje do pliku randomX.bin
 // Symuluje pracę wątku przez odczyt READCHUNKS fragmentów danych
-void read_random(int thread_id)
+// Zwraca 0 albo errno pierwszego błędu (błąd kończy zadanie, nie program)
+int read_random(int thread_id)
 {
     char file_name[20];
     char buffer[BUFFERSIZE];
     snprintf(file_name, sizeof(file_name), "random%d.bin", thread_id);
     printf("Writing to a file %s\n", file_name);
-    int i, in, out;
+    int i, in, out, error = 0;
     ssize_t count;
     if ((out = TEMP_FAILURE_RETRY(open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0777))) < 0)
-        ERR("open");
+        return errno;
     if ((in = TEMP_FAILURE_RETRY(open("/dev/urandom", O_RDONLY))) < 0)
-        ERR("open");
-    for (i = 0; i < READCHUNKS; i++)
     {
-        if ((count = bulk_read(in, buffer, BUFFERSIZE)) < 0)
-            ERR("bulk_read");
-        if ((count = bulk_write(out, buffer, count)) < 0)
-            ERR("bulk_write");
-        sleep(1);
+        error = errno;
+        close(out);
+        return error;
     }
-    if (TEMP_FAILURE_RETRY(close(in)))
-        ERR("close");
-    if (TEMP_FAILURE_RETRY(close(out)))
-        ERR("close");
+    for (i = 0; i < READCHUNKS && !error; i++)
+    {
+        if ((count = bulk_read(in, buffer, BUFFERSIZE)) < 0 || bulk_write(out, buffer, count) < 0)
+            error = errno;
+        else
+            sleep(1);
+    }
+    if (TEMP_FAILURE_RETRY(close(in)) && !error)
+        error = errno;
+    if (TEMP_FAILURE_RETRY(close(out)) && !error)
+        error = errno;
+    return error;
 }
 
-// Główna funkcja wątku w puli - czeka na zadania używając mutex i zmiennej warunku
-// Implementuje wzorzec producent-konsument dla puli wątków
-void *thread_func(void *arg)
+// Numer zadania w komunikatach: "N", a dla zadania z paczki "B.N" - numery w
+// paczce zaczynają się od 1, więc same powtarzałyby numery zadań z linii
+const char *job_label(char *label, size_t size, const job_t *job)
 {
-    thread_arg targ;
-    memcpy(&targ, arg, sizeof(targ));
-    while (1)
+    if (job->batch == NULL)
+        snprintf(label, size, "%ld", job->id);
+    else
+        snprintf(label, size, "%ld.%ld", job->batch->id, job->id);
+    return label;
+}
+
+// Nazwa i-tego pliku zadania JOB_GENERATE; dla zadania z paczki według jej wzorca
+void job_file_name(char *name, size_t size, const job_t *job, int i)
+{
+    const char *mark;
+    if (job->batch == NULL || (mark = strchr(job->batch->path, '#')) == NULL)
+        snprintf(name, size, "random%ld-%d.bin", job->id, i);
+    else
+        snprintf(name, size, "%.*s%ld-%d%s", (int)(mark - job->batch->path), job->batch->path, job->id, i, mark + 1);
+}
+
+// Przydziela bufor slotu przy pierwszym użyciu; zwraca 0 albo errno
+int worker_buffer(worker_t *w)
+{
+    int error;
+    if (w->gen_buf != NULL)
+        return 0;
+    if ((error = posix_memalign((void **)&w->gen_buf, GEN_ALIGN, GEN_BUFFER)) != 0)
+        return error;
+    /* pierwszy zapis przydziela strony na węźle NUMA procesora, na którym działa wątek slotu */
+    memset(w->gen_buf, 0, GEN_BUFFER);
+    return 0;
+}
+
+// Wypełnia bufor losowymi bajtami z getrandom() (obsługuje przerwania i krótkie odczyty)
+// Zwraca 0 albo errno
+int fill_kernel(char *buf, size_t len)
+{
+    ssize_t c;
+    while (len > 0)
     {
-        pthread_cleanup_push(cleanup, (void *)targ.mutex);
-        if (pthread_mutex_lock(targ.mutex) != 0)
-            ERR("pthread_mutex_lock");
-        (*targ.idlethreads)++;
-        while (!*targ.condition && work)
-            if (pthread_cond_wait(targ.cond, targ.mutex) != 0)
-                ERR("pthread_cond_wait");
-        *targ.condition = 0;
-        if (!work)
-            pthread_exit(NULL);
-        (*targ.idlethreads)--;
-        pthread_cleanup_pop(1);
-        read_random(targ.id);
+        if ((c = TEMP_FAILURE_RETRY(getrandom(buf, len, 0))) < 0)
+            return errno;
+        buf += c;
+        len -= c;
     }
-    return NULL;
+    return 0;
 }
 
-// Inicjalizuje pulę wątków - tworzy THREAD_NUM wątków roboczych
-// Każdy wątek otrzymuje referencje do wspólnych struktur synchronizacyjnych
-void init(pthread_t *thread, thread_arg *targ, pthread_cond_t *cond, pthread_mutex_t *mutex, int *idlethreads,
-          int *condition)
+static inline uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+// Wypełnia bufor generatorem xoshiro256** wątku - kilka cykli na 8 bajtów,
+// bez wywołań systemowych; len musi być wielokrotnością 8
+void fill_xoshiro(uint64_t *s, char *buf, size_t len)
 {
-    int i;
-    for (i = 0; i < THREAD_NUM; i++)
-    {
-        targ[i].id = i + 1;
-        targ[i].cond = cond;
-        targ[i].mutex = mutex;
-        targ[i].idlethreads = idlethreads;
-        targ[i].condition = condition;
-        if (pthread_create(&thread[i], NULL, thread_func, (void *) &targ[i]) != 0)
-            ERR("pthread_create");
+    uint64_t *out = (uint64_t *)buf;
+    size_t i;
+    for (i = 0; i < len / 8; i++)
+    {
+        uint64_t t = s[1] << 17;
+        out[i] = rotl(s[1] * 5, 7) * 9;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
     }
 }
 
-// Główna pętla zarządzająca zadaniami - czyta dane wejściowe i przydziela pracę
-// Używa mutex do synchronizacji dostępu do licznika bezczynnych wątków
-void do_work(pthread_cond_t *cond, pthread_mutex_t *mutex, const int *idlethreads, int *condition)
+// Zapisuje dokładnie 'count' bajtów od pozycji 'offset' (obsługuje przerwania)
+ssize_t bulk_pwrite(int fd, const char *buf, size_t count, off_t offset)
 {
-    char buffer[BUFFERSIZE];
-    while (work)
+    ssize_t c;
+    size_t len = 0;
+    while (count > 0)
     {
-        if (fgets(buffer, BUFFERSIZE, stdin) != NULL)
+        if ((c = TEMP_FAILURE_RETRY(pwrite(fd, buf, count, offset))) < 0)
+            return c;
+        buf += c;
+        len += c;
+        offset += c;
+        count -= c;
+    }
+    return len;
+}
+
+// Otwiera plik wyjściowy generatora; przy GEN_DIRECT rezerwuje miejsce przez
+// fallocate i próbuje O_DIRECT (system plików bez O_DIRECT, np. tmpfs, dostaje zwykły zapis)
+// Zwraca deskryptor albo -1 (errno ustawione)
+int open_generated(const char *name, size_t size, int flags, int *direct)
+{
+    int fd = -1, error;
+    *direct = 0;
+    if (flags & GEN_DIRECT)
+    {
+        fd = TEMP_FAILURE_RETRY(open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666));
+        if (fd >= 0)
+            *direct = 1;
+        else if (errno != EINVAL)
+            return -1;
+    }
+    if (fd < 0 && (fd = TEMP_FAILURE_RETRY(open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666))) < 0)
+        return -1;
+    if ((flags & GEN_DIRECT) && size > 0 && fallocate(fd, 0, 0, size) < 0 && errno != EOPNOTSUPP)
+    {
+        error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+// Tryb szybki: job->files plików po job->size bajtów, generowanych do
+// wyrównanego bufora wątku i zapisywanych pwrite po GEN_BUFFER bajtów
+// Przy O_DIRECT ostatni zapis jest dopełniany do GEN_ALIGN, a plik przycinany
+// Zwraca 0, errno pierwszego błędu albo EINTR, gdy SIGINT przerwał generowanie
+int generate_files(worker_t *w, job_t *job)
+{
+    char file_name[BUFFERSIZE + 48];
+    struct timespec start, end;
+    size_t total = 0;
+    int i, fd, direct, error;
+    if ((error = worker_buffer(w)) != 0)
+        return error;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < job->files && !error; i++)
+    {
+        job_file_name(file_name, sizeof(file_name), job, i);
+        if ((fd = open_generated(file_name, job->size, job->flags, &direct)) < 0)
         {
-            if (pthread_mutex_lock(mutex) != 0)
-                ERR("pthread_mutex_lock");
-            if (*idlethreads == 0)
-            {
-                if (pthread_mutex_unlock(mutex) != 0)
-                    ERR("pthread_mutex_unlock");
-                fputs("No threads available\n", stderr);
-            }
-            else
-            {
-                if (pthread_mutex_unlock(mutex) != 0)
-                    ERR("pthread_mutex_unlock");
-                *condition = 1;
-                if (pthread_cond_signal(cond) != 0)
-                    ERR("pthread_cond_signal");
-            }
+            error = errno;
+            break;
         }
-        else
+        off_t offset = 0;
+        while ((size_t)offset < job->size && !error)
         {
-            if (EINTR == errno)
-                continue;
-            ERR("fgets");
+            size_t len = job->size - offset < GEN_BUFFER ? job->size - offset : GEN_BUFFER;
+            size_t padded = direct ? (len + GEN_ALIGN - 1) & ~(size_t)(GEN_ALIGN - 1) : (len + 7) & ~(size_t)7;
+            if (!work)
+                error = EINTR;
+            else if (job->flags & GEN_KERNEL)
+                error = fill_kernel(w->gen_buf, padded);
+            else
+                fill_xoshiro(w->xoshiro, w->gen_buf, padded);
+            if (!error && bulk_pwrite(fd, w->gen_buf, direct ? padded : len, offset) < 0)
+                error = errno;
+            if (!error)
+                offset += len;
         }
+        if (!error && direct && ftruncate(fd, offset) < 0)
+            error = errno;
+        if (TEMP_FAILURE_RETRY(close(fd)) && !error)
+            error = errno;
+        total += offset;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ns = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+    atomic_fetch_add_explicit(&w->gen_bytes, total, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->gen_ns, ns, memory_order_relaxed);
+    char label[LABEL_SIZE];
+    printf("Thread %d: job %s wrote %d files, %.1f MB in %.3f s (%.2f GB/s)\n", w->id,
+           job_label(label, sizeof(label), job), i, total / 1e6, ns / 1e9, ns ? (double)total / ns : 0.0);
+    return error;
 }
 
-int main(int argc, char **argv)
+// Dokłada słowo do sumy kontrolnej
+static inline uint64_t checksum_mix(uint64_t h, uint64_t v)
 {
-    int i, condition = 0, idlethreads = 0;
-    pthread_t thread[THREAD_NUM];
-    thread_arg targ[THREAD_NUM];
-    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    set_handler(sigint_handler, SIGINT);
-    init(thread, targ, &cond, &mutex, &idlethreads, &condition);
-    do_work(&cond, &mutex, &idlethreads, &condition);
-    if (pthread_cond_broadcast(&cond) != 0)
-        ERR("pthread_cond_broadcast");
-    for (i = 0; i < THREAD_NUM; i++)
-        if (pthread_join(thread[i], NULL) != 0)
-            ERR("pthread_join");
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    h ^= v;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+// Suma kontrolna wszystkich plików zadań, od których job zależy - czytane
+// pread po GEN_BUFFER bajtów do bufora slotu. Zwraca 0 albo errno
+int checksum_files(worker_t *w, job_t *job)
+{
+    char file_name[BUFFERSIZE + 48];
+    uint64_t h = 0;
+    int i, k, fd, error;
+    if ((error = worker_buffer(w)) != 0)
+        return error;
+    for (i = 0; i < job->ninputs && !error; i++)
+        for (k = 0; k < job->inputs[i]->files && !error; k++)
+        {
+            job_file_name(file_name, sizeof(file_name), job->inputs[i], k);
+            if ((fd = TEMP_FAILURE_RETRY(open(file_name, O_RDONLY))) < 0)
+                return errno;
+            off_t offset = 0;
+            ssize_t len;
+            while ((len = TEMP_FAILURE_RETRY(pread(fd, w->gen_buf, GEN_BUFFER, offset))) > 0)
+            {
+                uint64_t *words = (uint64_t *)w->gen_buf, tail = 0;
+                size_t j;
+                for (j = 0; j < (size_t)len / 8; j++)
+                    h = checksum_mix(h, words[j]);
+                if (len % 8)
+                {
+                    memcpy(&tail, w->gen_buf + len - len % 8, len % 8);
+                    h = checksum_mix(h, tail);
+                }
+                offset += len;
+            }
+            if (len < 0)
+                error = errno;
+            if (TEMP_FAILURE_RETRY(close(fd)) && !error)
+                error = errno;
+        }
+    job->result = h;
+    printf("Thread %d: job %ld checksum %016llx\n", w->id, job->id, (unsigned long long)h);
+    return error;
+}
+
+// Łączy sumy kontrolne poprzedników (w kolejności zależności)
+void merge_results(worker_t *w, job_t *job)
+{
+    uint64_t h = 0;
+    int i;
+    for (i = 0; i < job->ninputs; i++)
+        h = checksum_mix(h, job->inputs[i]->result);
+    job->result = h;
+    printf("Thread %d: job %ld merged %d inputs: %016llx\n", w->id, job->id, job->ninputs, (unsigned long long)h);
+}
+
+// Położenie procesora w topologii (z /sys/devices/system/cpu)
+typedef struct
+{
+    int cpu, package, core, node;
+    int core_rank;  // numer rdzenia w obrębie pakietu (0, 1, ...)
+    int smt;        // numer wątku sprzętowego w obrębie rdzenia
+} cpu_info_t;
+
+// Czyta liczbę z pliku sysfs; def gdy pliku nie ma
+int sysfs_int(const char *path, int def)
+{
+    FILE *f = fopen(path, "r");
+    int value = def;
+    if (f == NULL)
+        return def;
+    if (fscanf(f, "%d", &value) != 1)
+        value = def;
+    fclose(f);
+    return value;
+}
+
+// Węzeł NUMA procesora - katalog nodeN w /sys/devices/system/cpu/cpuX (0 bez NUMA)
+int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *entry;
+    DIR *dir;
+    int node = 0;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(path)) == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL)
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+            break;
+    closedir(dir);
+    return node;
+}
+
+// Odczytuje topologię procesorów, na których proces może działać; zwraca ich liczbę
+int topology_read(cpu_info_t **out)
+{
+    char path[96];
+    cpu_set_t allowed;
+    cpu_info_t *cpus;
+    int cpu, i, j, n = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        ERR("sched_getaffinity");
+    if ((cpus = calloc(CPU_COUNT(&allowed), sizeof(cpu_info_t))) == NULL)
+        ERR("calloc");
+    for (cpu = 0; cpu < CPU_SETSIZE && n < CPU_COUNT(&allowed); cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        cpus[n].cpu = cpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        cpus[n].package = sysfs_int(path, 0);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        cpus[n].core = sysfs_int(path, cpu);
+        cpus[n].node = cpu_node(cpu);
+        n++;
+    }
+    /* numery rdzeni w pakiecie i wątków w rdzeniu - procesory są po kolei, więc wystarczy policzyć poprzedników */
+    for (i = 0; i < n; i++)
+        for (j = 0; j < i; j++)
+        {
+            if (cpus[j].package != cpus[i].package)
+                continue;
+            if (cpus[j].core == cpus[i].core)
+                cpus[i].smt++;
+            else if (cpus[j].smt == 0)
+                cpus[i].core_rank++;
+        }
+    for (i = 0; i < n; i++)
+        for (j = 0; j < i; j++)
+            if (cpus[j].package == cpus[i].package && cpus[j].core == cpus[i].core)
+            {
+                cpus[i].core_rank = cpus[j].core_rank;
+                break;
+            }
+    *out = cpus;
+    return n;
+}
+
+// compact: pakiet po pakiecie, w pakiecie rdzeń po rdzeniu razem z wątkami SMT
+int cpu_cmp_compact(const void *a, const void *b)
+{
+    const cpu_info_t *x = a, *y = b;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core_rank != y->core_rank)
+        return x->core_rank - y->core_rank;
+    return x->smt - y->smt;
+}
+
+// scatter: kolejne wątki na kolejnych pakietach, najpierw osobne rdzenie, wątki SMT na końcu
+int cpu_cmp_scatter(const void *a, const void *b)
+{
+    const cpu_info_t *x = a, *y = b;
+    if (x->smt != y->smt)
+        return x->smt - y->smt;
+    if (x->core_rank != y->core_rank)
+        return x->core_rank - y->core_rank;
+    return x->package - y->package;
+}
+
+// Przypisuje slotom puli procesory według polityki "compact", "scatter" albo
+// listy procesorów ("0,2,4-7", sloty biorą je po kolei i w kółko) i wypisuje
+// wynikowe rozmieszczenie. Zwraca -1 przy błędnej polityce lub procesorze spoza
+// dozwolonych
+int affinity_plan(pool_t *pool, const char *policy)
+{
+    cpu_info_t *cpus, *order;
+    int i, j, n = topology_read(&cpus), count = 0, packages = 0, nodes = 0;
+    if ((order = calloc(n, sizeof(cpu_info_t))) == NULL)
+        ERR("calloc");
+    if (strcmp(policy, "compact") == 0 || strcmp(policy, "scatter") == 0)
+    {
+        memcpy(order, cpus, n * sizeof(cpu_info_t));
+        qsort(order, n, sizeof(cpu_info_t), policy[0] == 'c' ? cpu_cmp_compact : cpu_cmp_scatter);
+        count = n;
+    }
+    else
+    {
+        const char *p = policy;
+        char *end;
+        int bad = 0;
+        while (*p && !bad)
+        {
+            long first = strtol(p, &end, 10), last = first;
+            if (end == p || first < 0)
+            {
+                bad = 1;
+                break;
+            }
+            if (*end == '-')
+            {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+                if (end == p || last < first)
+                {
+                    bad = 1;
+                    break;
+                }
+            }
+            for (; first <= last; first++)
+            {
+                for (j = 0; j < n && cpus[j].cpu != first; j++)
+                    ;
+                if (j == n)
+                {
+                    fprintf(stderr, "CPU %ld is not available\n", first);
+                    free(order);
+                    free(cpus);
+                    return -1;
+                }
+                if (count == n)
+                    break;
+                order[count++] = cpus[j];
+            }
+            if (*end != ',' && *end)
+                bad = 1;
+            p = *end == ',' ? end + 1 : end;
+        }
+        if (bad || count == 0)
+        {
+            free(order);
+            free(cpus);
+            return -1;
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        for (j = 0; j < i && cpus[j].package != cpus[i].package; j++)
+            ;
+        packages += j == i;
+        for (j = 0; j < i && cpus[j].node != cpus[i].node; j++)
+            ;
+        nodes += j == i;
+    }
+    printf("affinity: %s, %d of %d cpus, %d packages, %d nodes\n", policy, count, n, packages, nodes);
+    for (i = 0; i < pool->max; i++)
+    {
+        cpu_info_t *c = &order[i % count];
+        pool->workers[i].cpu = c->cpu;
+        printf("  slot %d -> cpu %d (package %d core %d node %d)\n", i, c->cpu, c->package, c->core, c->node);
+    }
+    free(order);
+    free(cpus);
+    return 0;
+}
+
+void *thread_func(void *arg);
+
+// Budzi jeden uśpiony wątek, jeśli jakiś śpi. Szybka ścieżka (nikt nie śpi)
+// nie robi żadnego wywołania systemowego ani blokady
+void pool_wake_one(pool_t *pool)
+{
+    int i;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&pool->parked) == 0)
+        return;
+    for (i = 0; i < pool->max; i++)
+    {
+        int expected = WORKER_PARKED;
+        if (atomic_compare_exchange_strong(&pool->workers[i].state, &expected, WORKER_RUNNING))
+        {
+            atomic_fetch_sub(&pool->parked, 1);
+            futex_wake(&pool->workers[i].state, 1);
+            return;
+        }
+    }
+}
+
+// Budzi wszystkie uśpione wątki (przy zamykaniu puli)
+void pool_wake_all(pool_t *pool)
+{
+    int i;
+    for (i = 0; i < pool->max; i++)
+    {
+        int expected = WORKER_PARKED;
+        if (atomic_compare_exchange_strong(&pool->workers[i].state, &expected, WORKER_RUNNING))
+        {
+            atomic_fetch_sub(&pool->parked, 1);
+            futex_wake(&pool->workers[i].state, 1);
+        }
+    }
+}
+
+// Uruchamia nowy wątek w wolnym slocie puli; wywoływana z zablokowanym pool->mutex
+// Wątki są odłączone - przy zamykaniu pula czeka, aż size spadnie do zera
+void pool_spawn(pool_t *pool)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    worker_t *w = pool->workers;
+    while (w->active)
+        w++;
+    w->active = 1;
+    w->id = ++pool->next_id;
+    w->rng = w->id * 2654435761u;
+    if (fill_kernel((char *)w->xoshiro, sizeof(w->xoshiro)) != 0)
+        ERR("getrandom");
+    atomic_store(&w->state, WORKER_RUNNING);
+    if (pthread_attr_init(&attr) != 0 || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0)
+        ERR("pthread_attr");
+    if (w->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0)
+            ERR("pthread_attr_setaffinity_np");
+    }
+    if (pthread_create(&tid, &attr, thread_func, (void *)w) != 0)
+        ERR("pthread_create");
+    pthread_attr_destroy(&attr);
+    pool->size++;
+    pool->spawned++;
+}
+
+// Dokłada wątek, jeśli żaden wątek nie śpi, pula nie osiągnęła max, a najstarsze
+// zadanie w kolejce czeka za długo albo w czyjejś deque leży zadanie, którego nie ma kto ukraść
+void pool_maybe_grow(pool_t *pool)
+{
+    long wait = queue_oldest_wait(&pool->queue);
+    int i, backlog = 0;
+    for (i = 0; i < pool->max && !backlog; i++)
+        backlog = !deque_empty(&pool->workers[i].deque);
+    if (pthread_mutex_lock(&pool->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    if ((wait > pool->spawn_wait_ms || backlog) && atomic_load(&pool->parked) == 0 && pool->size < pool->max)
+        pool_spawn(pool);
+    if (pthread_mutex_unlock(&pool->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+}
+
+// Wypisuje stan puli (rozmiar, zajęte wątki, kolejka, liczniki utworzeń, zakończeń i kradzieży)
+// oraz przepustowość generatora w slotach, które coś zapisały
+void pool_stats(pool_t *pool)
+{
+    int i, queued = queue_pending(&pool->queue, NULL);
+    if (pthread_mutex_lock(&pool->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    long dropped = 0;
+    for (i = 0; i < PRIO_CLASSES; i++)
+        dropped += atomic_load(&pool->dropped[i]);
+    printf("pool: size=%d busy=%d queued=%d blocked=%ld min=%d max=%d spawned=%ld retired=%ld steals=%ld parks=%ld "
+           "dropped=%ld\n",
+           pool->size, pool->size - atomic_load(&pool->parked), queued, atomic_load(&pool->blocked), pool->min,
+           pool->max, pool->spawned, pool->retired, atomic_load(&pool->steals), atomic_load(&pool->parks), dropped);
+    for (i = 0; i < pool->max; i++)
+    {
+        worker_t *w = &pool->workers[i];
+        long bytes = atomic_load(&w->gen_bytes), ns = atomic_load(&w->gen_ns);
+        if (bytes > 0)
+            printf("worker %d: %.1f MB generated, %.2f GB/s\n", w->id, bytes / 1e6, ns ? (double)bytes / ns : 0.0);
+    }
+    if (pthread_mutex_unlock(&pool->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+}
+
+// Wstawia gotowe zadanie do kolejki wejściowej; przy pełnej kolejce czeka
+// (nic nie jest odrzucane), sprawdzając co PUSH_TIMEOUT_MS, czy program nie ma się zakończyć
+// Budzi wątek tylko przy przejściu kolejki z pustej w niepustą - przy dłuższej
+// kolejce ktoś już nie śpi, a obudzony wątek zabiera całą paczkę i sam budzi następnego
+// Zwraca -1, gdy zadanie nie zostało przyjęte, bo program się kończy
+int pool_enqueue(pool_t *pool, job_t *job)
+{
+    int depth;
+    while (queue_push(&pool->queue, job, PUSH_TIMEOUT_MS, &depth) == ETIMEDOUT)
+    {
+        if (!work)
+            return -1;
+        fputs("Queue full, waiting\n", stderr);
+    }
+    if (depth == 1)
+        pool_wake_one(pool);
+    return 0;
+}
+
+void job_resolve(pool_t *pool, worker_t *w, job_t *job);
+
+// Zadanie, którego ostatni poprzednik właśnie się zakończył. Trafia do deque
+// kończącego wątku w (bez żadnej wspólnej blokady), a bez wątku - do kolejki
+// wejściowej. Gdy któryś poprzednik zawiódł, zadanie jest anulowane razem ze
+// swoimi następnikami. Zwraca 1, gdy zadanie trafiło do deque w
+int job_ready(pool_t *pool, worker_t *w, job_t *job)
+{
+    atomic_fetch_sub(&pool->blocked, 1);
+    if (atomic_load(&job->dep_failed))
+    {
+        job_cancel(job);
+        job_resolve(pool, w, job);
+        job_release(job);
+        return 0;
+    }
+    /* czas czekania w kolejce liczony od gotowości, priorytet (rank) zostaje z chwili zgłoszenia */
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+    if (w == NULL)
+    {
+        if (pool_enqueue(pool, job) < 0)
+        {
+            job_cancel(job);
+            job_resolve(pool, NULL, job);
+            job_release(job);
+        }
+        return 0;
+    }
+    if (deque_push(&w->deque, job) < 0)
+    {
+        job->next = w->overflow;
+        w->overflow = job;
+    }
+    return 1;
+}
+
+// Zamyka listę następników zakończonego zadania (stan końcowy już ustawiony)
+// i zmniejsza ich liczniki; gotowi następnicy trafiają do deque wątku w,
+// a dla nadmiaru budzone są uśpione wątki, żeby go ukradły
+void job_resolve(pool_t *pool, worker_t *w, job_t *job)
+{
+    int ok = atomic_load(&job->status) == JOB_DONE, pushed = 0;
+    edge_t *edge = atomic_exchange(&job->successors, &edges_closed), *next;
+    for (; edge != NULL; edge = next)
+    {
+        job_t *succ = edge->job;
+        next = edge->next;
+        free(edge);
+        if (!ok)
+            atomic_store(&succ->dep_failed, 1);
+        if (atomic_fetch_sub(&succ->pending, 1) == 1)
+            pushed += job_ready(pool, w, succ);
+    }
+    while (pushed-- > 1)
+        pool_wake_one(pool);
+}
+
+// Zapisuje rekordy do strumienia wyników; gdy jest nim stdout, najpierw
+// opróżnia bufor stdio, żeby rekordy nie wyprzedzały wcześniejszych komunikatów
+void results_write(pool_t *pool, char *buf, size_t len)
+{
+    if (pool->results_fd == STDOUT_FILENO)
+        fflush(stdout);
+    if (bulk_write(pool->results_fd, buf, len) < 0)
+        ERR("write");
+}
+
+// Zapisuje zebrane rekordy wątku do strumienia wyników
+void records_flush(pool_t *pool, worker_t *w)
+{
+    if (w->records_len > 0)
+        results_write(pool, w->records, w->records_len);
+    w->records_len = 0;
+}
+
+// Rekord zakończenia zadania z paczki: "B.N stan czekanie_us wykonanie_us [błąd]",
+// a po ostatnim zadaniu paczki "batch B finished: count jobs, done done, ms ms"
+// Wątek zbiera rekordy we własnym buforze i zapisuje je jednym write najwyżej
+// PIPE_BUF bajtów (rekordy różnych wątków nie przeplatają się w potoku) - przed
+// uśpieniem albo końcem paczki; bez wątku (w == NULL) rekord idzie od razu
+void job_record(pool_t *pool, worker_t *w, job_t *job, long wait_ns, long run_ns)
+{
+    char local[2 * RECORD_MAX];
+    char *buf = w ? w->records : local;
+    size_t len = w ? w->records_len : 0;
+    batch_t *batch = job->batch;
+    int n, status = atomic_load(&job->status);
+    if (len > PIPE_BUF - 2 * RECORD_MAX)
+    {
+        records_flush(pool, w);
+        len = 0;
+    }
+    n = snprintf(buf + len, RECORD_MAX, "%ld.%ld %s %ld %ld%s%s\n", batch->id, job->id, job_status_name(status),
+                 wait_ns / 1000, run_ns / 1000, status == JOB_FAILED ? " " : "",
+                 status == JOB_FAILED ? strerror(job->error) : "");
+    if (n >= RECORD_MAX)
+    {
+        n = RECORD_MAX - 1;
+        buf[len + n - 1] = '\n';
+    }
+    len += n;
+    atomic_fetch_add_explicit(&pool->batch_status[status], 1, memory_order_relaxed);
+    if (status == JOB_DONE)
+        atomic_fetch_add(&batch->done, 1);
+    int last = atomic_fetch_sub(&batch->remaining, 1) == 1;
+    if (last)
+    {
+        n = snprintf(buf + len, RECORD_MAX, "batch %ld finished: %ld jobs, %ld done, %ld ms\n", batch->id,
+                     batch->count, atomic_load(&batch->done), elapsed_ms(&batch->submitted));
+        len += n < RECORD_MAX ? n : RECORD_MAX - 1;
+    }
+    if (w == NULL)
+    {
+        results_write(pool, buf, len);
+        return;
+    }
+    w->records_len = len;
+    if (last)
+        records_flush(pool, w);
+}
+
+// Wykonuje zadanie, zapisuje jego stan i czasy do histogramów klasy, zwalnia
+// następników i referencję puli. Zadanie anulowane przed startem jest tylko
+// zwalniane, a to, którego termin minął, jest odrzucane i liczone w dropped
+void run_job(worker_t *w, job_t *job)
+{
+    struct timespec started;
+    char label[LABEL_SIZE];
+    int error = 0, expected = JOB_QUEUED;
+    if (!atomic_compare_exchange_strong(&job->status, &expected, JOB_RUNNING))
+    {
+        if (job->batch != NULL)
+            job_record(w->pool, w, job, 0, 0);
+        job_resolve(w->pool, w, job);
+        job_release(job);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    long wait_ns = timespec_ns(&started) - timespec_ns(&job->submitted);
+    if (job->deadline && timespec_ns(&started) > job->deadline)
+    {
+        atomic_fetch_add_explicit(&w->pool->dropped[job->prio], 1, memory_order_relaxed);
+        job_finish(job, JOB_EXPIRED, 0);
+        if (job->batch != NULL)
+            job_record(w->pool, w, job, wait_ns, 0);
+        job_resolve(w->pool, w, job);
+        job_release(job);
+        return;
+    }
+    hist_record(&w->pool->wait_hist[job->prio], wait_ns);
+    switch (job->type)
+    {
+    case JOB_RANDOM:
+        printf("Thread %d: job %s (waited %ld ms)\n", w->id, job_label(label, sizeof(label), job),
+               elapsed_ms(&job->submitted));
+        error = read_random(w->id);
+        break;
+    case JOB_GENERATE:
+        error = generate_files(w, job);
+        break;
+    case JOB_SPIN:
+        while (elapsed_ns(&started) < (long)job->size * 1000)
+            ;
+        break;
+    case JOB_CHECKSUM:
+        error = checksum_files(w, job);
+        break;
+    case JOB_MERGE:
+        merge_results(w, job);
+        break;
+    case JOB_STRESS:
+        atomic_fetch_add_explicit(&stress_runs[job->id - 1], 1, memory_order_relaxed);
+        break;
+    case JOB_NOOP:
+        break;
+    }
+    long run_ns = elapsed_ns(&started);
+    hist_record(&w->pool->run_hist[job->prio], run_ns);
+    if (error)
+        printf("Thread %d: job %s failed: %s\n", w->id, job_label(label, sizeof(label), job), strerror(error));
+    job_finish(job, error ? JOB_FAILED : JOB_DONE, error);
+    if (job->batch != NULL)
+        job_record(w->pool, w, job, wait_ns, run_ns);
+    job_resolve(w->pool, w, job);
+    job_release(job);
+}
+
+// Szuka pracy: najpierw własna deque, chyba że czoło kolejki wejściowej ma
+// wcześniejszy termin - wtedy paczka z kolejki (reszta paczki trafia do deque,
+// skąd mogą ją ukraść inni); na końcu kradzież z deque losowych innych wątków
+// Paczka bierze tylko zadania pilniejsze od tych w deque, bo ląduje na jej
+// dole - inaczej świeże zadania bez końca zasłaniałyby starsze
+// Pobranie paczki budzi jeden śpiący wątek, a złodziej, który zostawił w deque
+// ofiary jeszcze coś, budzi następny - pobudka idzie kaskadą, aż śpiący
+// wątki rozbiorą całą paczkę albo deque się opróżni
+job_t *find_job(worker_t *w)
+{
+    pool_t *pool = w->pool;
+    job_t *batch[GRAB_BATCH];
+    job_t *job;
+    int i, n, room;
+    long next;
+    while (w->overflow != NULL && deque_count(&w->deque) < DEQUE_SIZE)
+    {
+        job = w->overflow;
+        w->overflow = job->next;
+        deque_push(&w->deque, job);
+    }
+    room = DEQUE_SIZE - deque_count(&w->deque) + 1;
+    next = deque_next_rank(&w->deque);
+    if (atomic_load_explicit(&pool->queue.top_rank, memory_order_relaxed) >= next &&
+        (job = deque_take(&w->deque)) != NULL)
+        return job;
+    if ((n = queue_take(&pool->queue, batch, room < GRAB_BATCH ? room : GRAB_BATCH, next)) > 0)
+    {
+        for (i = n - 1; i > 0; i--)
+            if (deque_push(&w->deque, batch[i]) < 0)
+                ERR("deque_push");
+        if (n > 1)
+            pool_wake_one(pool);
+        return batch[0];
+    }
+    if ((job = deque_take(&w->deque)) != NULL)
+        return job;
+    for (i = 0; i < 2 * pool->max; i++)
+    {
+        w->rng = w->rng * 1103515245u + 12345u;
+        worker_t *victim = &pool->workers[(w->rng >> 16) % pool->max];
+        if (victim != w && (job = deque_steal(&victim->deque)) != NULL)
+        {
+            atomic_fetch_add_explicit(&pool->steals, 1, memory_order_relaxed);
+            if (!deque_empty(&victim->deque))
+                pool_wake_one(pool);
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Czy gdziekolwiek czeka praca - sprawdzane po ogłoszeniu uśpienia, żeby nie
+// zasnąć z zadaniem dodanym w międzyczasie
+int work_pending(pool_t *pool, int *closed)
+{
+    int i;
+    if (queue_pending(&pool->queue, closed) > 0)
+        return 1;
+    for (i = 0; i < pool->max; i++)
+        if (!deque_empty(&pool->workers[i].deque))
+            return 1;
+    return 0;
+}
+
+// Usypia wątek na jego własnym futeksie (najwyżej idle_timeout_ms)
+// Zwraca -1 gdy wątek ma się zakończyć, 0 gdy ma dalej szukać pracy
+int worker_park(worker_t *w)
+{
+    pool_t *pool = w->pool;
+    int closed, expected = WORKER_PARKED;
+    records_flush(pool, w);
+    atomic_store(&w->state, WORKER_PARKED);
+    atomic_fetch_add(&pool->parked, 1);
+    if (work_pending(pool, &closed) || closed || !work)
+    {
+        /* rezygnacja z uśpienia; jeśli ktoś zdążył obudzić, sam zmniejszył parked */
+        if (atomic_compare_exchange_strong(&w->state, &expected, WORKER_RUNNING))
+            atomic_fetch_sub(&pool->parked, 1);
+        if (!work || (closed && !work_pending(pool, NULL)))
+            return -1;
+        return 0;
+    }
+    atomic_fetch_add_explicit(&pool->parks, 1, memory_order_relaxed);
+    int timeout = futex_wait(&w->state, WORKER_PARKED, pool->idle_timeout_ms);
+    if (!atomic_compare_exchange_strong(&w->state, &expected, WORKER_RUNNING))
+        return 0;  // obudzony przez pool_wake_one
+    atomic_fetch_sub(&pool->parked, 1);
+    if (timeout != ETIMEDOUT)
+        return 0;
+
+    /* bezczynność dłuższa niż idle_timeout_ms - wątek znika, jeśli pula jest większa niż min */
+    if (pthread_mutex_lock(&pool->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    int retire = pool->size > pool->min && !pool->closing;
+    if (retire)
+    {
+        w->active = 0;
+        pool->size--;
+        pool->retired++;
+    }
+    if (pthread_mutex_unlock(&pool->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    return retire ? 1 : 0;
+}
+
+// Główna funkcja wątku w puli - wykonuje zadania z własnej deque, kolejki
+// i cudzych deque, a bez pracy śpi na własnym futeksie zamiast wspólnej zmiennej warunku
+void *thread_func(void *arg)
+{
+    worker_t *w = arg;
+    pool_t *pool = w->pool;
+    job_t *job;
+    int ret;
+    while (work)
+    {
+        if ((job = find_job(w)) != NULL)
+        {
+            run_job(w, job);
+            continue;
+        }
+        if ((ret = worker_park(w)) == 1)
+            return NULL;  // wycofany z puli w worker_park
+        if (ret < 0)
+            break;
+    }
+    records_flush(pool, w);
+    if (pthread_mutex_lock(&pool->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    w->active = 0;
+    pool->size--;
+    if (pthread_cond_signal(&pool->exited) != 0)
+        ERR("pthread_cond_signal");
+    if (pthread_mutex_unlock(&pool->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    return NULL;
+}
+
+// Wątek nadzorcy - okresowo sprawdza czas czekania najstarszego zadania, bo gdy
+// wszystkie wątki wykonują długie zadania, nikt inny nie zagląda do kolejki
+void *pool_manager(void *arg)
+{
+    pool_t *pool = arg;
+    struct timespec deadline;
+    int ret;
+    if (pthread_mutex_lock(&pool->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    while (!pool->closing && work)
+    {
+        deadline_after(&deadline, pool->spawn_wait_ms / 2 + 1);
+        ret = pthread_cond_timedwait(&pool->exited, &pool->mutex, &deadline);
+        if (ret != 0 && ret != ETIMEDOUT)
+            ERR("pthread_cond_timedwait");
+        if (pthread_mutex_unlock(&pool->mutex) != 0)
+            ERR("pthread_mutex_unlock");
+        pool_maybe_grow(pool);
+        if (pthread_mutex_lock(&pool->mutex) != 0)
+            ERR("pthread_mutex_lock");
+    }
+    if (pthread_mutex_unlock(&pool->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    return NULL;
+}
+
+// Inicjalizuje pulę wątków - tworzy min wątków roboczych, reszta powstaje pod obciążeniem
+// affinity (NULL - bez przypinania) to polityka dla affinity_plan; zwraca -1, gdy jest błędna
+// results_fd (strumień rekordów paczek) jest ustawiany przed startem wątków, które go czytają
+int init(pool_t *pool, int min, int max, int spawn_wait_ms, int idle_timeout_ms, const char *affinity, int results_fd)
+{
+    int i;
+    memset(pool, 0, sizeof(pool_t));
+    queue_init(&pool->queue);
+    pool->results_fd = results_fd;
+    pool->min = min;
+    pool->max = max;
+    pool->spawn_wait_ms = spawn_wait_ms;
+    pool->idle_timeout_ms = idle_timeout_ms;
+    if ((pool->workers = calloc(max, sizeof(worker_t))) == NULL)
+        ERR("calloc");
+    for (i = 0; i < max; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].cpu = -1;
+    }
+    if (affinity && affinity_plan(pool, affinity) < 0)
+    {
+        free(pool->workers);
+        queue_destroy(&pool->queue);
+        return -1;
+    }
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+        ERR("pthread_mutex_init");
+    if (pthread_cond_init(&pool->exited, NULL) != 0)
+        ERR("pthread_cond_init");
+    if (pthread_mutex_lock(&pool->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    for (i = 0; i < min; i++)
+        pool_spawn(pool);
+    if (pthread_mutex_unlock(&pool->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    if (pthread_create(&pool->manager, NULL, pool_manager, pool) != 0)
+        ERR("pthread_create");
+    return 0;
+}
+
+// Wylicza termin bezwzględny i klucz kolejności zadania od chwili zgłoszenia
+void job_stamp(job_t *job)
+{
+    job->rank = timespec_ns(&job->submitted) + prio_aging_ms[job->prio] * 1000000L;
+    job->deadline = job->deadline_ms > 0 ? timespec_ns(&job->submitted) + job->deadline_ms * 1000000L : 0;
+    if (job->deadline && job->deadline < job->rank)
+        job->rank = job->deadline;
+}
+
+// Zgłasza zadanie (z job_new) do puli z klasą job->prio i opcjonalnym terminem
+// job->deadline_ms. Zadanie z niezakończonymi poprzednikami (job_depend) czeka
+// poza kolejką, aż ostatni z nich się zakończy
+// Zwraca przekazany uchwyt - referencję zgłaszającego zwalnia job_release; gdy
+// program kończy się, zanim kolejka przyjęła zadanie, ma ono stan JOB_CANCELLED
+job_t *pool_submit(pool_t *pool, job_t *job)
+{
+    atomic_fetch_add(&job->refs, 1);
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+    job_stamp(job);
+    atomic_fetch_add(&pool->blocked, 1);
+    if (atomic_fetch_sub(&job->pending, 1) > 1)
+        return job;
+    atomic_fetch_sub(&pool->blocked, 1);
+    if (atomic_load(&job->dep_failed) || pool_enqueue(pool, job) < 0)
+    {
+        job_cancel(job);
+        job_resolve(pool, NULL, job);
+        job_release(job);
+    }
+    return job;
+}
+
+// Porzuca zadanie, którego pula już nie wykona (zamykanie po SIGINT);
+// jego następnicy też zostają anulowani
+void job_abandon(pool_t *pool, job_t *job)
+{
+    job_cancel(job);
+    if (job->batch != NULL)
+        job_record(pool, NULL, job, 0, 0);
+    job_resolve(pool, NULL, job);
+    job_release(job);
+}
+
+// Zgłasza paczkę batch->count kopii proto: zadania tworzą łańcuchy po
+// BATCH_CHAIN, a każdy łańcuch zajmuje jedno miejsce w kolejce i trafia do niej
+// jedną operacją; wątki zabierają z niego po GRAB_BATCH do swoich deque.
+// Długość łańcucha ogranicza liczbę zadań czekających w kolejce do
+// (QUEUE_SIZE + QUEUE_RESERVE) * BATCH_CHAIN, więc pełna kolejka nadal
+// wstrzymuje producenta, a zadania powstają dopiero przed wstawieniem.
+// Referencje zadań przechodzą na pulę (wyniki idą do strumienia rekordów);
+// zwraca -1, gdy program kończy się, zanim kolejka przyjęła całą paczkę -
+// pozostałe zadania dostają wtedy stan JOB_CANCELLED
+int pool_submit_batch(pool_t *pool, const job_t *proto, batch_t *batch)
+{
+    job_t *head, *job;
+    long i = batch->count, chain;
+    int ret = 0;
+    clock_gettime(CLOCK_MONOTONIC, &batch->submitted);
+    atomic_store(&batch->remaining, batch->count);
+    for (chain = 1; i > 0; i -= chain)
+    {
+        chain = i < BATCH_CHAIN ? i : BATCH_CHAIN;
+        head = NULL;
+        for (long k = batch->count - i + chain; k > batch->count - i; k--)
+        {
+            job = job_new(proto, k);
+            job->batch = batch;
+            atomic_fetch_add(&batch->refs, 1);
+            atomic_store(&job->pending, 0);
+            job->submitted = batch->submitted;
+            job_stamp(job);
+            job->next = head;
+            head = job;
+        }
+        if (ret == 0 && pool_enqueue(pool, head) == 0)
+            continue;
+        ret = -1;
+        while ((job = head) != NULL)
+        {
+            head = job->next;
+            job->next = NULL;
+            job_abandon(pool, job);
+        }
+    }
+    return ret;
+}
+
+// Zamyka kolejkę i czeka, aż wszystkie wątki puli się zakończą; zadania
+// niewykonane po SIGINT dostają stan JOB_CANCELLED
+void pool_shutdown(pool_t *pool)
+{
+    int i;
+    job_t *job;
+    queue_close(&pool->queue);
+    if (pthread_mutex_lock(&pool->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    pool->closing = 1;
+    if (pthread_cond_broadcast(&pool->exited) != 0)
+        ERR("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&pool->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    if (pthread_join(pool->manager, NULL) != 0)
+        ERR("pthread_join");
+    pool_wake_all(pool);
+    if (pthread_mutex_lock(&pool->mutex) != 0)
+        ERR("pthread_mutex_lock");
+    while (pool->size > 0)
+        if (pthread_cond_wait(&pool->exited, &pool->mutex) != 0)
+            ERR("pthread_cond_wait");
+    if (pthread_mutex_unlock(&pool->mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    while (queue_take(&pool->queue, &job, 1, LONG_MAX) > 0)
+        job_abandon(pool, job);
+    for (i = 0; i < pool->max; i++)
+    {
+        worker_t *w = &pool->workers[i];
+        while ((job = deque_take(&w->deque)) != NULL || (job = w->overflow) != NULL)
+        {
+            if (job == w->overflow)
+                w->overflow = job->next;
+            job_abandon(pool, job);
+        }
+        free(w->gen_buf);
+    }
+    free(pool->workers);
+    pthread_cond_destroy(&pool->exited);
+    pthread_mutex_destroy(&pool->mutex);
+    queue_destroy(&pool->queue);
+}
+
+// Uchwyty zadań zgłoszonych z wejścia; numer zadania to indeks + 1
+typedef struct
+{
+    job_t **jobs;
+    long count, cap;
+} handles_t;
+
+void handles_add(handles_t *h, job_t *job)
+{
+    if (h->count == h->cap)
+    {
+        job_t **grown = realloc(h->jobs, (h->cap ? 2 * h->cap : 64) * sizeof(job_t *));
+        if (grown == NULL)
+            ERR("realloc");
+        h->jobs = grown;
+        h->cap = h->cap ? 2 * h->cap : 64;
+    }
+    h->jobs[h->count++] = job;
+}
+
+// Wykonuje polecenie "wait N", "poll N" albo "cancel N"; zwraca -1, gdy
+// linia nie jest poleceniem o zadaniu
+int job_command(handles_t *h, const char *line)
+{
+    char cmd[8];
+    long id;
+    int status;
+    if (sscanf(line, "%7s %ld", cmd, &id) != 2 || (strcmp(cmd, "wait") && strcmp(cmd, "poll") && strcmp(cmd, "cancel")))
+        return -1;
+    if (id < 1 || id > h->count)
+    {
+        printf("job %ld: no such job\n", id);
+        return 0;
+    }
+    job_t *job = h->jobs[id - 1];
+    if (strcmp(cmd, "cancel") == 0)
+    {
+        printf("job %ld: %s\n", id, job_cancel(job) == 0 ? "cancelled" : "too late to cancel");
+        return 0;
+    }
+    if (strcmp(cmd, "wait") == 0)
+        while ((status = job_wait(job, PUSH_TIMEOUT_MS)) < 0 && work)
+            ;
+    status = job_poll(job);
+    if (status == JOB_FAILED)
+        printf("job %ld: failed (%s)\n", id, strerror(job->error));
+    else
+        printf("job %ld: %s\n", id, job_status_name(status));
+    return 0;
+}
+
+// Podsumowanie po zamknięciu puli: liczba zadań w każdym stanie końcowym
+// (razem z zadaniami z paczek) i lista nieudanych zadań z linii; zwalnia uchwyty
+void handles_report(handles_t *h, pool_t *pool)
+{
+    long counts[JOB_EXPIRED + 1] = {0};
+    long i;
+    for (i = 0; i <= JOB_EXPIRED; i++)
+        counts[i] = atomic_load(&pool->batch_status[i]);
+    for (i = 0; i < h->count; i++)
+    {
+        job_t *job = h->jobs[i];
+        int status = job_poll(job);
+        counts[status]++;
+        if (status == JOB_FAILED)
+            printf("job %ld: failed (%s)\n", job->id, strerror(job->error));
+        job_release(job);
+    }
+    printf("jobs: %ld done, %ld failed, %ld cancelled, %ld expired\n", counts[JOB_DONE], counts[JOB_FAILED],
+           counts[JOB_CANCELLED], counts[JOB_EXPIRED]);
+    free(h->jobs);
+}
+
+// Zamienia nazwę klasy priorytetu na prio_t; -1 gdy nieznana
+int prio_parse(const char *name)
+{
+    int i;
+    for (i = 0; i < PRIO_CLASSES; i++)
+        if (strcmp(name, prio_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// Histogramy i licznik odrzuconych dla każdej klasy, która miała zadania;
+// full dodaje rozkład przedziałów
+void pool_latency(pool_t *pool, int full)
+{
+    char name[32];
+    int i;
+    for (i = 0; i < PRIO_CLASSES; i++)
+    {
+        long dropped = atomic_load(&pool->dropped[i]);
+        if (atomic_load(&pool->wait_hist[i].total) == 0 && dropped == 0)
+            continue;
+        snprintf(name, sizeof(name), "%s queue wait", prio_names[i]);
+        hist_dump(name, &pool->wait_hist[i], full);
+        snprintf(name, sizeof(name), "%s run time", prio_names[i]);
+        hist_dump(name, &pool->run_hist[i], full);
+        if (dropped)
+            printf("%s dropped after deadline: %ld\n", prio_names[i], dropped);
+    }
+}
+
+// Zamienia rozmiar z opcjonalnym przyrostkiem K, M albo G na bajty; -1 przy błędzie
+long long parse_size(const char *text)
+{
+    char *end;
+    long long size = strtoll(text, &end, 10);
+    if (end == text || size < 0)
+        return -1;
+    switch (*end)
+    {
+    case 'G':
+        size <<= 10;
+        /* fall through */
+    case 'M':
+        size <<= 10;
+        /* fall through */
+    case 'K':
+        size <<= 10;
+        end++;
+        break;
+    }
+    return *end ? -1 : size;
+}
+
+// Polecenie "batch TYPE COUNT [size=N[K|M|G]] [files=N] [path=WZORZEC] [prio=KLASA]
+// [deadline=MS]" - COUNT zadań typu noop, spin (size w µs) albo generate
+// (size bajtów w każdym z files plików o nazwach z wzorca, w którym '#' zastępuje
+// "numer-plik") zgłoszonych jedną operacją na kolejce. Brakujące parametry
+// pochodzą z proto. Zwraca -1, gdy linia nie jest poleceniem batch
+int batch_command(pool_t *pool, const job_t *proto, char *line, long *next_batch)
+{
+    static const char *types[] = {"noop", "spin", "generate"};
+    static const job_type_t type_ids[] = {JOB_NOOP, JOB_SPIN, JOB_GENERATE};
+    char record[RECORD_MAX], *save, *token, *end;
+    const char *error = NULL, *path = NULL;
+    job_t batch_proto = *proto;
+    long long size = -1;
+    long count = 0;
+    int i, n;
+    if (strncmp(line, "batch ", 6) != 0)
+        return -1;
+    strtok_r(line, " \t\n", &save);
+    if ((token = strtok_r(NULL, " \t\n", &save)) == NULL)
+        error = "missing job type";
+    for (i = 0; !error && i < (int)(sizeof(types) / sizeof(types[0])) && strcmp(token, types[i]); i++)
+        ;
+    if (!error && i == (int)(sizeof(types) / sizeof(types[0])))
+        error = "job type must be noop, spin or generate";
+    else if (!error)
+        batch_proto.type = type_ids[i];
+    if (!error && ((token = strtok_r(NULL, " \t\n", &save)) == NULL || (count = strtol(token, &end, 10)) < 1 ||
+                   *end || count > BATCH_MAX))
+        error = "bad count";
+    while (!error && (token = strtok_r(NULL, " \t\n", &save)) != NULL)
+    {
+        if (strncmp(token, "size=", 5) == 0)
+            error = (size = parse_size(token + 5)) < 0 ? "bad size" : NULL;
+        else if (strncmp(token, "files=", 6) == 0)
+            error = (batch_proto.files = atoi(token + 6)) < 1 ? "bad file count" : NULL;
+        else if (strncmp(token, "path=", 5) == 0)
+            error = strchr(path = token + 5, '#') == NULL ? "path must contain '#'" : NULL;
+        else if (strncmp(token, "prio=", 5) == 0)
+            error = (n = prio_parse(token + 5)) < 0 ? "unknown class" : (batch_proto.prio = n, NULL);
+        else if (strncmp(token, "deadline=", 9) == 0)
+            error = (batch_proto.deadline_ms = atol(token + 9)) < 0 ? "bad deadline" : NULL;
+        else
+            error = "unknown parameter";
+    }
+    if (size >= 0)
+        batch_proto.size = size;
+    else if (batch_proto.type != proto->type)
+        batch_proto.size = 0;
+    if (!error && batch_proto.type == JOB_GENERATE && batch_proto.size == 0)
+        error = "generate needs size=";
+    if (error)
+    {
+        printf("batch: %s\n", error);
+        return 0;
+    }
+    batch_t *batch = malloc(sizeof(batch_t));
+    if (batch == NULL)
+        ERR("malloc");
+    batch->id = ++*next_batch;
+    batch->count = count;
+    if (path)
+        snprintf(batch->path, sizeof(batch->path), "%s", path);
+    else
+        snprintf(batch->path, sizeof(batch->path), "batch%ld-#.bin", batch->id);
+    atomic_store(&batch->done, 0);
+    atomic_store(&batch->refs, 1);
+    /* potwierdzenie przed zgłoszeniem - rekordy zadań mogą pojawić się zaraz potem */
+    n = snprintf(record, sizeof(record), "batch %ld queued: %ld jobs\n", batch->id, count);
+    results_write(pool, record, n);
+    pool_submit_batch(pool, &batch_proto, batch);
+    batch_release(batch);
+    return 0;
+}
+
+// Główna pętla zarządzająca zadaniami - każda linia wejścia to jedno zadanie
+// (kopia proto); linia zaczynająca się od klasy "high", "normal" albo "bulk"
+// i opcjonalnego terminu w ms zmienia je dla tego zadania, a "after N M ..."
+// uzależnia je od zakończenia zadań N, M, ... Linie "stats"
+// i "hist" wypisują stan puli i histogramy opóźnień, "wait N", "poll N"
+// i "cancel N" działają na uchwycie zadania N, a "batch ..." zgłasza paczkę
+// zadań (batch_command), które nie dostają uchwytów - ich wyniki trafiają do
+// strumienia rekordów
+void do_work(pool_t *pool, const job_t *proto, handles_t *handles)
+{
+    char buffer[BUFFERSIZE];
+    long next_id = 1, next_batch = 0;
+    while (work)
+    {
+        if (fgets(buffer, BUFFERSIZE, stdin) != NULL)
+        {
+            if (strcmp(buffer, "stats\n") == 0)
+            {
+                pool_stats(pool);
+                continue;
+            }
+            if (strcmp(buffer, "hist\n") == 0)
+            {
+                pool_latency(pool, 1);
+                continue;
+            }
+            if (job_command(handles, buffer) == 0 || batch_command(pool, proto, buffer, &next_batch) == 0)
+                continue;
+            job_t *job = job_new(proto, next_id++);
+            char cls[8], *after;
+            long deadline_ms = 0;
+            int prio;
+            if (sscanf(buffer, "%7s %ld", cls, &deadline_ms) >= 1 && (prio = prio_parse(cls)) >= 0)
+            {
+                job->prio = prio;
+                job->deadline_ms = deadline_ms > 0 ? deadline_ms : 0;
+            }
+            if ((after = strstr(buffer, "after")) != NULL)
+            {
+                char *p = after + 5, *end;
+                long id;
+                while ((id = strtol(p, &end, 10)), end != p)
+                {
+                    if (id >= 1 && id <= handles->count)
+                        job_depend(job, handles->jobs[id - 1]);
+                    else
+                        printf("job %ld: no such job\n", id);
+                    p = end;
+                }
+            }
+            handles_add(handles, pool_submit(pool, job));
+        }
+        else
+        {
+            if (EINTR == errno)
+                continue;
+            if (feof(stdin))
+                break;
+            ERR("fgets");
+        }
+    }
+}
+
+// Tryb -b: zgłasza count zadań najszybciej jak się da i wypisuje przepustowość
+// puli - dla pustych zadań sam narzut kolejki, deque i usypiania, dla -s także GB/s zapisu
+void run_benchmark(pool_t *pool, long count, const job_t *proto)
+{
+    struct timespec start;
+    long i;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count && work; i++)
+        job_release(pool_submit(pool, job_new(proto, i + 1)));
+    pool_shutdown(pool);
+    long ms = elapsed_ms(&start);
+    printf("benchmark: %ld jobs in %ld ms (%.0f jobs/s)\n", i, ms, ms ? i * 1000.0 / ms : 0.0);
+    if (proto->type == JOB_GENERATE && ms)
+        printf("benchmark: %.2f GB/s total\n", (double)i * proto->files * proto->size / ms / 1e6);
+}
+
+// Kolejka odniesienia dla -c: tablica cykliczna pod jednym mutexem z dwiema
+// zmiennymi warunku, z której każdy wątek bierze po jednym zadaniu - tak działała
+// pula przed deque wątków. Służy tylko do porównania z pulą na pustych zadaniach
+typedef struct
+{
+    job_t *jobs[QUEUE_SIZE];
+    int head, count, closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty, not_full;
+} ref_queue_t;
+
+void *reference_worker(void *arg)
+{
+    ref_queue_t *q = arg;
+    job_t *job;
+    while (1)
+    {
+        if (pthread_mutex_lock(&q->mutex) != 0)
+            ERR("pthread_mutex_lock");
+        while (q->count == 0 && !q->closed)
+            if (pthread_cond_wait(&q->not_empty, &q->mutex) != 0)
+                ERR("pthread_cond_wait");
+        if (q->count == 0)
+        {
+            if (pthread_mutex_unlock(&q->mutex) != 0)
+                ERR("pthread_mutex_unlock");
+            return NULL;
+        }
+        job = q->jobs[q->head];
+        q->head = (q->head + 1) % QUEUE_SIZE;
+        q->count--;
+        if (pthread_cond_signal(&q->not_full) != 0)
+            ERR("pthread_cond_signal");
+        if (pthread_mutex_unlock(&q->mutex) != 0)
+            ERR("pthread_mutex_unlock");
+        job_finish(job, JOB_DONE, 0);
+        job_release(job);
+    }
+}
+
+// Tryb -c, pierwsza połowa: count pustych zadań przez kolejkę odniesienia i
+// threads wątków; druga połowa to zwykłe -b na puli z tą samą liczbą zadań
+void run_reference(long count, int threads, const job_t *proto)
+{
+    ref_queue_t q = {.head = 0, .count = 0, .closed = 0};
+    pthread_t tids[threads];
+    struct timespec start;
+    long i;
+    int t;
+    if (pthread_mutex_init(&q.mutex, NULL) != 0 || pthread_cond_init(&q.not_empty, NULL) != 0 ||
+        pthread_cond_init(&q.not_full, NULL) != 0)
+        ERR("pthread_init");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (t = 0; t < threads; t++)
+        if (pthread_create(&tids[t], NULL, reference_worker, &q) != 0)
+            ERR("pthread_create");
+    for (i = 0; i < count && work; i++)
+    {
+        job_t *job = job_new(proto, i + 1);
+        if (pthread_mutex_lock(&q.mutex) != 0)
+            ERR("pthread_mutex_lock");
+        while (q.count == QUEUE_SIZE)
+            if (pthread_cond_wait(&q.not_full, &q.mutex) != 0)
+                ERR("pthread_cond_wait");
+        q.jobs[(q.head + q.count) % QUEUE_SIZE] = job;
+        q.count++;
+        if (pthread_cond_signal(&q.not_empty) != 0)
+            ERR("pthread_cond_signal");
+        if (pthread_mutex_unlock(&q.mutex) != 0)
+            ERR("pthread_mutex_unlock");
+    }
+    if (pthread_mutex_lock(&q.mutex) != 0)
+        ERR("pthread_mutex_lock");
+    q.closed = 1;
+    if (pthread_cond_broadcast(&q.not_empty) != 0)
+        ERR("pthread_cond_broadcast");
+    if (pthread_mutex_unlock(&q.mutex) != 0)
+        ERR("pthread_mutex_unlock");
+    for (t = 0; t < threads; t++)
+        if (pthread_join(tids[t], NULL) != 0)
+            ERR("pthread_join");
+    long ms = elapsed_ms(&start);
+    printf("reference: %ld jobs in %ld ms (%.0f jobs/s), one locked queue, %d threads\n", i, ms,
+           ms ? i * 1000.0 / ms : 0.0, threads);
+    pthread_mutex_destroy(&q.mutex);
+    pthread_cond_destroy(&q.not_empty);
+    pthread_cond_destroy(&q.not_full);
+}
+
+// Producent zadań interaktywnych dla -x: co MIX_PERIOD_US na przemian zadanie
+// high z terminem i zadanie normal, dopóki producent bulk nie skończy
+typedef struct
+{
+    pool_t *pool;
+    atomic_int running;
+    long submitted;
+} mixed_arg_t;
+
+void *mixed_interactive(void *arg)
+{
+    mixed_arg_t *mix = arg;
+    struct timespec period = {0, MIX_PERIOD_US * 1000L};
+    while (atomic_load(&mix->running) && work)
+    {
+        int high = mix->submitted % 2 == 0;
+        job_t proto = {.type = JOB_SPIN, .files = 1};
+        proto.prio = high ? PRIO_HIGH : PRIO_NORMAL;
+        proto.size = high ? MIX_HIGH_US : MIX_NORMAL_US;
+        proto.deadline_ms = high ? MIX_HIGH_DEADLINE_MS : 0;
+        job_release(pool_submit(mix->pool, job_new(&proto, ++mix->submitted)));
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+// Tryb -x: count zadań bulk (MIX_BULK_US każde) zgłaszanych najszybciej jak się
+// da, a równolegle strumień zadań high i normal; na koniec opóźnienia każdej klasy
+void run_mixed(pool_t *pool, long count)
+{
+    mixed_arg_t mix = {.pool = pool, .running = 1};
+    job_t proto = {.type = JOB_SPIN, .files = 1, .prio = PRIO_BULK, .size = MIX_BULK_US};
+    struct timespec start;
+    pthread_t tid;
+    long i;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pthread_create(&tid, NULL, mixed_interactive, &mix) != 0)
+        ERR("pthread_create");
+    for (i = 0; i < count && work; i++)
+        job_release(pool_submit(pool, job_new(&proto, i + 1)));
+    atomic_store(&mix.running, 0);
+    if (pthread_join(tid, NULL) != 0)
+        ERR("pthread_join");
+    pool_shutdown(pool);
+    printf("mixed: %ld bulk and %ld interactive jobs in %ld ms\n", i, mix.submitted, elapsed_ms(&start));
+    pool_latency(pool, 0);
+}
+
+// Producent dla -t: zgłasza zadania o numerach first..first+count-1 seriami
+// po STRESS_BURST z krótką przerwą, żeby kolejka na zmianę zapełniała się
+// (producenci czekają) i opróżniała (wątki zasypiają albo się wycofują)
+typedef struct
+{
+    pool_t *pool;
+    long first, count;
+} stress_arg_t;
+
+void *stress_producer(void *arg)
+{
+    stress_arg_t *st = arg;
+    struct timespec pause = {0, 1000000L};
+    job_t proto = {.type = JOB_STRESS, .files = 1};
+    long i;
+    for (i = 0; i < st->count && work; i++)
+    {
+        proto.prio = (st->first + i) % PRIO_CLASSES;
+        job_release(pool_submit(st->pool, job_new(&proto, st->first + i)));
+        if ((i + 1) % STRESS_BURST == 0)
+            nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// Tryb -t: STRESS_PRODUCERS wątków zgłasza razem count zadań seriami, a po
+// zamknięciu puli sprawdza, że każde zadanie wykonało się dokładnie raz
+// Zwraca EXIT_SUCCESS albo EXIT_FAILURE, gdy któreś zginęło lub powtórzyło się
+int run_stress(pool_t *pool, long count)
+{
+    stress_arg_t args[STRESS_PRODUCERS];
+    pthread_t tids[STRESS_PRODUCERS];
+    struct timespec start;
+    long i, missing = 0, duplicated = 0;
+    if ((stress_runs = calloc(count, sizeof(atomic_int))) == NULL)
+        ERR("calloc");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < STRESS_PRODUCERS; i++)
+    {
+        args[i].pool = pool;
+        args[i].first = 1 + i * (count / STRESS_PRODUCERS);
+        args[i].count = i == STRESS_PRODUCERS - 1 ? count - i * (count / STRESS_PRODUCERS) : count / STRESS_PRODUCERS;
+        if (pthread_create(&tids[i], NULL, stress_producer, &args[i]) != 0)
+            ERR("pthread_create");
+    }
+    for (i = 0; i < STRESS_PRODUCERS; i++)
+        if (pthread_join(tids[i], NULL) != 0)
+            ERR("pthread_join");
+    pool_stats(pool);
+    pool_shutdown(pool);
+    for (i = 0; i < count; i++)
+    {
+        int runs = atomic_load(&stress_runs[i]);
+        if (runs == 0)
+            missing++;
+        else if (runs > 1)
+            duplicated++;
+    }
+    free(stress_runs);
+    printf("stress: %ld jobs from %d producers in %ld ms, %ld missing, %ld duplicated%s\n", count,
+           STRESS_PRODUCERS, elapsed_ms(&start), missing, duplicated, work ? "" : " (interrupted)");
+    return missing || duplicated ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Czeka na zakończenie zadania; zwraca jego stan końcowy (-1 po SIGINT)
+int job_join(job_t *job)
+{
+    int status;
+    while ((status = job_wait(job, PUSH_TIMEOUT_MS)) < 0 && work)
+        ;
+    return status;
+}
+
+// Jeden przebieg potoku -g: count zadań generate (wzorzec proto), dla każdego
+// checksum jego plików i na końcu merge wszystkich sum. Jako graf (staged == 0)
+// każde zadanie zależy tylko od swoich poprzedników, więc etapy się nakładają;
+// etapami (staged == 1) każdy etap czeka na koniec całego poprzedniego
+// Zwraca czas w ms, a w *result wynik merge
+long pipeline_pass(pool_t *pool, long count, const job_t *proto, int staged, long *next_id, uint64_t *result)
+{
+    job_t stage = *proto, **gens, **sums, *merge;
+    struct timespec start;
+    long i;
+    if ((gens = calloc(count, sizeof(job_t *))) == NULL || (sums = calloc(count, sizeof(job_t *))) == NULL)
+        ERR("calloc");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++)
+        gens[i] = pool_submit(pool, job_new(proto, (*next_id)++));
+    for (i = 0; staged && i < count; i++)
+        job_join(gens[i]);
+    stage.type = JOB_CHECKSUM;
+    for (i = 0; i < count; i++)
+    {
+        sums[i] = job_new(&stage, (*next_id)++);
+        job_depend(sums[i], gens[i]);
+        pool_submit(pool, sums[i]);
+    }
+    for (i = 0; staged && i < count; i++)
+        job_join(sums[i]);
+    stage.type = JOB_MERGE;
+    merge = job_new(&stage, (*next_id)++);
+    for (i = 0; i < count; i++)
+        job_depend(merge, sums[i]);
+    pool_submit(pool, merge);
+    job_join(merge);
+    long ms = elapsed_ms(&start);
+    *result = merge->result;
+    job_release(merge);
+    for (i = 0; i < count; i++)
+    {
+        job_release(sums[i]);
+        job_release(gens[i]);
+    }
+    free(sums);
+    free(gens);
+    return ms;
+}
+
+// Tryb -g: potok generate -> checksum -> merge uruchomiony raz jako graf
+// zależności i raz etapami, dla porównania czasów
+void run_pipeline(pool_t *pool, long count, const job_t *proto)
+{
+    long next_id = 1, dag, staged;
+    uint64_t result;
+    dag = pipeline_pass(pool, count, proto, 0, &next_id, &result);
+    printf("pipeline: graph %ld ms (merge %016llx)\n", dag, (unsigned long long)result);
+    staged = pipeline_pass(pool, count, proto, 1, &next_id, &result);
+    printf("pipeline: staged %ld ms (merge %016llx)\n", staged, (unsigned long long)result);
+    pool_shutdown(pool);
+}
+
+// Wypisuje składnię wywołania i kończy program
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-m min_threads] [-M max_threads] [-w spawn_wait_ms] [-i idle_timeout_ms]\n"
+                    "       [-s file_size[K|M|G] [-n file_count] [-d] [-k]] [-p high|normal|bulk]\n"
+                    "       [-a compact|scatter|cpu_list] [-r results_file]\n"
+                    "       [-b count | -c count | -x count | -g count | -t count]\n", name);
+    fprintf(stderr, "Each input line submits job N (numbered from 1). Commands: \"stats\" prints the pool state,\n"
+                    "\"hist\" the queue-wait and run-time histograms, \"wait N\", \"poll N\" and \"cancel N\"\n"
+                    "act on job N. A line starting with a class name and an optional deadline in ms\n"
+                    "(e.g. \"high 50\") submits the job with that priority; -p sets the default class.\n"
+                    "\"after N M ...\" in a line makes the job wait until jobs N, M, ... complete.\n");
+    fprintf(stderr, "\"batch noop|spin|generate count [size=N] [files=N] [path=pattern] [prio=class]\n"
+                    "[deadline=ms]\" submits count jobs at once; '#' in the pattern becomes \"index-file\".\n"
+                    "Each batch job writes a record \"B.N status wait_us run_us [error]\" and each batch\n"
+                    "\"batch B queued\" and \"batch B finished\" lines to the results stream (-r, default stdout).\n");
+    fprintf(stderr, "-s switches jobs to the fast generator: file_count files of file_size random bytes\n"
+                    "   each, -d uses fallocate and O_DIRECT, -k uses getrandom() instead of xoshiro256**.\n");
+    fprintf(stderr, "-a pins pool threads: compact fills one package core by core, scatter spreads\n"
+                    "   threads across packages and cores, a list such as 0,2,4-7 is used in order.\n");
+    fprintf(stderr, "-b submits count jobs (empty ones without -s) and prints the throughput.\n");
+    fprintf(stderr, "-c runs count empty jobs through one mutex/condition-variable queue with min threads\n"
+                    "   (the design before per-worker deques), then the same count through the pool.\n");
+    fprintf(stderr, "-g runs count generate jobs (-s, default 16M), a checksum per file and a merge, once\n"
+                    "   as a dependency graph and once stage by stage, and prints both times.\n");
+    fprintf(stderr, "-t submits count jobs in bursts from several producer threads and checks that\n"
+                    "   each job ran exactly once; the exit status is non-zero otherwise.\n");
+    fprintf(stderr, "-x runs count bulk jobs against a stream of high/normal jobs and prints latency per class.\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, min = THREAD_NUM, max = 4 * THREAD_NUM;
+    int spawn_wait_ms = SPAWN_WAIT_MS, idle_timeout_ms = IDLE_TIMEOUT_MS;
+    long bench = 0, compare = 0, mixed = 0, pipeline = 0, stress = 0;
+    const char *affinity = NULL, *results = NULL;
+    int results_fd = STDOUT_FILENO;
+    long long size;
+    job_t proto = {.type = JOB_RANDOM, .files = 1, .prio = PRIO_NORMAL};
+    handles_t handles = {0};
+    pool_t pool;
+    while ((opt = getopt(argc, argv, "m:M:w:i:b:c:s:n:dkp:x:a:g:r:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            min = atoi(optarg);
+            break;
+        case 'M':
+            max = atoi(optarg);
+            break;
+        case 'w':
+            spawn_wait_ms = atoi(optarg);
+            break;
+        case 'i':
+            idle_timeout_ms = atoi(optarg);
+            break;
+        case 'b':
+            bench = atol(optarg);
+            break;
+        case 'c':
+            compare = atol(optarg);
+            break;
+        case 's':
+            if ((size = parse_size(optarg)) < 0)
+                usage(argv[0]);
+            proto.type = JOB_GENERATE;
+            proto.size = size;
+            break;
+        case 'n':
+            proto.files = atoi(optarg);
+            break;
+        case 'd':
+            proto.flags |= GEN_DIRECT;
+            break;
+        case 'k':
+            proto.flags |= GEN_KERNEL;
+            break;
+        case 'p':
+            if ((opt = prio_parse(optarg)) < 0)
+                usage(argv[0]);
+            proto.prio = opt;
+            break;
+        case 'x':
+            mixed = atol(optarg);
+            break;
+        case 'a':
+            affinity = optarg;
+            break;
+        case 'g':
+            pipeline = atol(optarg);
+            break;
+        case 'r':
+            results = optarg;
+            break;
+        case 't':
+            stress = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (min < 1 || max < min || spawn_wait_ms < 0 || idle_timeout_ms < 1 || bench < 0 || mixed < 0 || pipeline < 0 ||
+        stress < 0 || compare < 0 || proto.files < 1)
+        usage(argv[0]);
+    if (bench && proto.type == JOB_RANDOM)
+        proto.type = JOB_NOOP;
+    if (results && (results_fd = TEMP_FAILURE_RETRY(open(results, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666))) < 0)
+        ERR("open");
+    set_handler(sigint_handler, SIGINT);
+    if (compare)
+    {
+        proto.type = JOB_NOOP;
+        run_reference(compare, min, &proto);
+        bench = compare;
+    }
+    if (init(&pool, min, max, spawn_wait_ms, idle_timeout_ms, affinity, results_fd) < 0)
+        usage(argv[0]);
+    if (bench)
+    {
+        run_benchmark(&pool, bench, &proto);
+        pool_latency(&pool, 0);
+        return EXIT_SUCCESS;
+    }
+    if (mixed)
+    {
+        run_mixed(&pool, mixed);
+        return EXIT_SUCCESS;
+    }
+    if (stress)
+        return run_stress(&pool, stress);
+    if (pipeline)
+    {
+        if (proto.type != JOB_GENERATE)
+        {
+            proto.type = JOB_GENERATE;
+            proto.size = 16 << 20;
+        }
+        run_pipeline(&pool, pipeline, &proto);
+        pool_latency(&pool, 0);
+        return EXIT_SUCCESS;
+    }
+    do_work(&pool, &proto, &handles);
+    pool_stats(&pool);
+    pool_shutdown(&pool);
+    handles_report(&handles, &pool);
+    pool_latency(&pool, 0);
+    if (results && TEMP_FAILURE_RETRY(close(results_fd)))
+        ERR("close");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Losowy test pokrycia fragmentów Task1: generuje duże pliki CSV (krótkie i długie
+# linie, pola cytowane z ',' '\n' i "" w środku, plik bez końcowego '\n'), a potem
+# dla kilku kombinacji n/m porównuje wynik ./task1 z "tail -n +2" - każdy rekord
+# musi wyjść dokładnie raz i w kolejności pliku, niezależnie od podziału.
+# Użycie: ./check-task1.sh [rozmiar_MB] [ziarno]   (ziarno powtarza te same pliki)
+
+size_mb=${1:-64}
+seed=${2:-$(date +%s)}
+task1=${TASK1:-./task1}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# gen plik ziarno rozmiar_MB cytowane(0/1) końcowy_newline(0/1)
+gen() {
+    awk -v seed="$2" -v size=$(($3 << 20)) -v quoted="$4" -v final_nl="$5" 'BEGIN {
+        srand(seed)
+        chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ._-"
+        for (i = 0; i < 8192; i++)
+            pool = pool substr(chars, int(rand() * length(chars)) + 1, 1)
+        printf "Name,Value\n"
+        total = 11
+        while (total < size) {
+            len = rand() < 0.9 ? int(rand() * 40) : int(rand() * 3000)
+            name = substr(pool, int(rand() * (8192 - len)) + 1, len)
+            if (quoted && rand() < 0.3) {
+                cut = int(rand() * (len + 1))
+                name = "\"" substr(name, 1, cut) (rand() < 0.5 ? "," : "\n") \
+                       substr(name, cut + 1) (rand() < 0.5 ? "\"\"" : "") "\""
+            }
+            line = name "," int(rand() * 1000000)
+            total += length(line) + 1
+            if (total >= size && !final_nl)
+                printf "%s", line
+            else
+                printf "%s\n", line
+        }
+    }' > "$1"
+}
+
+# check opis oczekiwany polecenie... - wynik polecenia musi być równy plikowi oczekiwanemu
+check() {
+    what=$1 expected=$2
+    shift 2
+    if "$@" > "$dir/out" 2> "$dir/err" && cmp -s "$dir/out" "$expected"; then
+        echo "ok    $what"
+    else
+        echo "FAIL  $what"
+        head -5 "$dir/err"
+        failed=1
+    fi
+}
+
+echo "seed $seed, ${size_mb} MB per file"
+gen "$dir/short.csv" "$seed" "$size_mb" 0 1
+gen "$dir/mixed.csv" $((seed + 1)) "$size_mb" 0 0
+gen "$dir/quoted.csv" $((seed + 2)) "$size_mb" 1 1
+
+for f in short mixed quoted; do
+    q=
+    [ $f = quoted ] && q=-q
+    tail -n +2 "$dir/$f.csv" > "$dir/$f.expected"
+    for nm in "1 1" "1 7" "2 64" "4 1000" "3 4099"; do
+        check "$f n/m=$nm" "$dir/$f.expected" $task1 -v $q $nm "$dir/$f.csv"
+    done
+    check "$f -i (build)" "$dir/$f.expected" $task1 -v $q -i 2 64 "$dir/$f.csv"
+    check "$f -i (load)" "$dir/$f.expected" $task1 -v $q -i 4 1000 "$dir/$f.csv"
+    check "$f -s" "$dir/$f.expected" $task1 $q -s -B 64 2 16 "$dir/$f.csv"
+    check "$f stdin" "$dir/$f.expected" sh -c "$task1 $q 2 16 - < \"$dir/$f.csv\""
+done
+
+# -q -g: klucze z ',' '\n' i "" wracają w cudzysłowach, więc wynik znów jest CSV
+printf 'Name,Value\n"a,b\nc""d",20008\nx,1\n"x",2\n' > "$dir/keys.csv"
+printf 'Name,count\n"a,b\nc""d",1\nx,2\n' > "$dir/keys.expected"
+check "quoted -g fixed keys" "$dir/keys.expected" $task1 -q -g Name 1 1 "$dir/keys.csv"
+
+# ten sam wynik dla losowych kluczy: wczytany ponownie przez -q ma tyle rekordów,
+# ile kluczy zostawia -u, a suma count to liczba wszystkich rekordów
+records=$($task1 -q -a Value 1 1 "$dir/quoted.csv" | sed -n 2p | cut -d, -f1)
+{ echo Name,Value; $task1 -q -u Name 2 64 "$dir/quoted.csv"; } > "$dir/uniq.csv"
+keys=$($task1 -q -a Value 1 1 "$dir/uniq.csv" | sed -n 2p | cut -d, -f1)
+echo "$keys,$records" > "$dir/groups.expected"
+check "quoted -g reparsed" "$dir/groups.expected" sh -c "$task1 -q -g Name 2 64 \"$dir/quoted.csv\" > \"$dir/groups.csv\" &&
+    $task1 -q -a count 1 1 \"$dir/groups.csv\" | sed -n 2p | cut -d, -f1,2"
+
+exit $failed